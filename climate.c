@@ -58,13 +58,120 @@
  *      surface temperature (Kelvin)
  */
 
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
 #include <float.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
+#include <unistd.h>
+
+#ifndef HAVE_ZLIB
+#define HAVE_ZLIB 0
+#endif
+#ifndef HAVE_ZSTD
+#define HAVE_ZSTD 0
+#endif
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* 50 US states by default; build with -DNUM_STATES=N to leave room for
+ * territories or other regions. */
+#ifndef NUM_STATES
 #define NUM_STATES 50
+#endif
+
+/* State codes are two uppercase letters, so they index a 26x26 table. */
+#define STATE_CODE_SLOTS (26 * 26)
+
+/* The TDV columns in file order, as X(name, kind, label). The kind picks
+ * how a column is parsed and where its value goes:
+ *      CODE        the two-letter state code; must be the first column
+ *      TIMESTAMP   milliseconds since the epoch (name timestamp)
+ *      GEOHASH     the location (name geohash)
+ *      DECIMAL, INTEGER    one of the measurements every report has:
+ *                  humidity, snow, cloud, lightning, pressure, temperature
+ *      EXTRA       any other decimal; states report its average as label
+ *      SKIP        a column that is not parsed
+ * The parser, record columns, caches, snapshots and reports are expanded
+ * from the list at compile time, so a layout only pays for the columns it
+ * has. Build with -DTDV_SCHEMA=NAME (make TDV_SCHEMA=NAME) to read the
+ * TDV_SCHEMA_NAME layout instead of the nine-column NOAA one. */
+#define TDV_SCHEMA_NOAA(X) \
+    X(code,         CODE,       "State") \
+    X(timestamp,    TIMESTAMP,  "Timestamp") \
+    X(geohash,      GEOHASH,    "Geolocation") \
+    X(humidity,     DECIMAL,    "Humidity") \
+    X(snow,         INTEGER,    "Snow Cover") \
+    X(cloud,        DECIMAL,    "Cloud Cover") \
+    X(lightning,    INTEGER,    "Lightning Strikes") \
+    X(pressure,     DECIMAL,    "Pressure") \
+    X(temperature,  DECIMAL,    "Temperature")
+
+/* The NOAA layout with wind (m/s, degrees) and precipitation (mm) after it. */
+#define TDV_SCHEMA_NOAA_WIND(X) \
+    TDV_SCHEMA_NOAA(X) \
+    X(wind_speed,     EXTRA,    "Wind Speed") \
+    X(wind_direction, SKIP,     "Wind Direction") \
+    X(precipitation,  EXTRA,    "Precipitation")
+
+#ifndef TDV_SCHEMA
+#define TDV_SCHEMA NOAA
+#endif
+#define TDV_SCHEMA_SELECT(name) TDV_SCHEMA_##name
+#define TDV_SCHEMA_LIST(name) TDV_SCHEMA_SELECT(name)
+#define TDV_COLUMNS TDV_SCHEMA_LIST(TDV_SCHEMA)
+
+/* TDV_IF_<kind>(...) keeps its arguments for EXTRA columns only. */
+#define TDV_IF_EXTRA(...) __VA_ARGS__
+#define TDV_IF_CODE(...)
+#define TDV_IF_TIMESTAMP(...)
+#define TDV_IF_GEOHASH(...)
+#define TDV_IF_DECIMAL(...)
+#define TDV_IF_INTEGER(...)
+#define TDV_IF_SKIP(...)
+
+/* TDV_COL_<name> is a column's position and TDV_FIELDS the column count;
+ * TDV_EXTRA_<name> numbers the EXTRA columns. */
+#define TDV_COLUMN_INDEX(name, kind, label) TDV_COL_##name,
+#define TDV_EXTRA_INDEX(name, kind, label) TDV_IF_##kind(TDV_EXTRA_##name,)
+enum tdv_column { TDV_COLUMNS(TDV_COLUMN_INDEX) TDV_FIELDS };
+enum tdv_extra { TDV_COLUMNS(TDV_EXTRA_INDEX) TDV_NUM_EXTRAS };
+_Static_assert(TDV_COL_code == 0, "the state code must be the first TDV column");
+
+/* Arrays of extra values keep one element when there are none. */
+#define TDV_EXTRA_SLOTS (TDV_NUM_EXTRAS > 0 ? TDV_NUM_EXTRAS : 1)
+
+/* Pipes and stdin are read through a buffer of this size, so memory use
+ * does not depend on the input size. Longer lines are discarded. */
+#define STREAM_BUFFER_SIZE (1 << 20)
 
 /* TODO: Add elements to the climate_info struct as necessary. */
 struct climate_info {
@@ -79,27 +186,960 @@ struct climate_info {
     int lightning;
     int snow;
     double cloud;
-    char* geoLocation;
     double pressure;
+    /* Neumaier compensation for the four sums above: what rounding dropped
+     * from each addition. A sum's value is sum + error. */
+    double humidityError;
+    double temperatureError;
+    double cloudError;
+    double pressureError;
+    double extra[TDV_EXTRA_SLOTS];      //sums of the EXTRA columns, compensated the same way
+    double extraError[TDV_EXTRA_SLOTS];
+};
+
+/* Bump allocator for aggregate records. Allocations are zeroed and are only
+ * released all at once, by arena_release(). */
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_ALIGN 64
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+struct arena {
+    struct arena_block *blocks;     //newest first
+};
+
+/* Per-geohash aggregates (--geohash=P). A cell is keyed on the state's slot
+ * key and the first P geohash characters packed five bits each, so cells
+ * from different tables merge by key alone. Cells live in fixed-size pages
+ * from the table's arena and index[] is an open-addressed hash of cell
+ * numbers (+1, so 0 marks an empty slot). */
+#define GEOHASH_MAX_PRECISION 10
+#define GEO_PAGE_CELLS 4096
+
+struct geo_cell {
+    uint64_t key;
+    unsigned int num_records;
+    int lightning;
+    double temperature;
+    double humidity;
+    double minTemp;
+    double maxTemp;
+};
+
+struct geo_table {
+    struct geo_cell **pages;
+    unsigned int num_pages;
+    unsigned int page_capacity;
+    unsigned int num_cells;
+    uint32_t *index;
+    unsigned int index_size;        //power of two
+};
+
+/* Time-bucketed rollups (--rollup=hour|day|month). Each state has a dense
+ * run of buckets starting at bucket number "first" (hours, days or months
+ * since the epoch, UTC). The run covers the calendar year of the state's
+ * first record and doubles in whichever direction a record falls outside.
+ * A run never spans more than ROLLUP_MAX_BUCKETS, so one bad timestamp
+ * cannot size it; a record beyond that is left out and counted as rejected. */
+enum rollup_unit { ROLLUP_NONE, ROLLUP_HOUR, ROLLUP_DAY, ROLLUP_MONTH };
+#define ROLLUP_MAX_BUCKETS (1LL << 20)      //about 120 years of hours, 40 MB per state
+
+struct time_bucket {
+    unsigned int num_records;
+    int lightning;
+    double temperature;
+    double humidity;
+    double minTemp;
+    double maxTemp;
+};
+
+struct time_series {
+    long long first;
+    long long length;
+    struct time_bucket *buckets;
+};
+
+/* --shared: with -j, workers add geohash cells and time buckets to one
+ * lock-free table instead of each growing its own copy. Groups are handed
+ * out densely by an atomic counter and published by a CAS into an
+ * open-addressed index, so untouched capacity costs no memory. Counts and
+ * sums are atomic adds; min/max are atomic maxima of order-preserving keys
+ * (see orderedKey()), so 0 means no value yet. Once SHARED_MAX_GROUPS are
+ * in use, new keys stay in the worker's own table and are merged at the
+ * end as before. */
+#define SHARED_INDEX_SLOTS (1 << 22)
+#define SHARED_MAX_GROUPS (SHARED_INDEX_SLOTS / 2)
+
+struct shared_group {
+    uint64_t key;                   //0: lost a race for its key, unused
+    unsigned int num_records;
+    int lightning;
+    uint64_t temperature;           //bits of a double sum
+    uint64_t humidity;              //bits of a double sum
+    uint64_t minKey;                //~orderedKey(min)
+    uint64_t maxKey;                //orderedKey(max)
+};
+
+struct shared_groups {
+    uint32_t *index;                //group number + 1, 0 = free
+    struct shared_group *groups;    //SHARED_MAX_GROUPS entries
+    unsigned int used;              //groups handed out (may overshoot when full)
+};
+
+struct shared_table {
+    struct shared_groups geo;       //keyed like geo cells
+    struct shared_groups rollup;    //keyed by rollupKey()
+};
+
+/* Percentile sketches (--percentiles) are merging t-digests: up to
+ * DIGEST_CAPACITY weighted centroids, kept sorted, plus a buffer of
+ * unsorted values folded in whenever it fills. Centroid sizes follow the
+ * arcsine scale, so tails get small centroids and p99 stays accurate, and
+ * memory is fixed however many values are added. */
+#define DIGEST_COMPRESSION 100
+#define DIGEST_CAPACITY (2 * DIGEST_COMPRESSION)
+#define DIGEST_BUFFER 256
+
+struct centroid {
+    double mean;
+    double weight;
+};
+
+struct digest {
+    double total;                   //weight of everything added, buffered or not
+    double min;
+    double max;
+    int num_centroids;
+    int num_buffered;
+    struct centroid centroids[DIGEST_CAPACITY];
+    struct centroid buffer[DIGEST_BUFFER];
+};
+
+struct state_digests {
+    struct digest temperature;
+    struct digest humidity;
+};
+
+/* --top K keeps each state's K hottest and K coldest readings in bounded
+ * heaps. Both keep the K largest keys (the temperature, or minus it for
+ * the coldest) under a total order, so heaps from different workers merge
+ * to the same K in any order. Once a heap is full, floor is its weakest
+ * key: a reading below it is rejected by that one comparison. */
+#define TOP_MAX 100
+
+struct extreme_event {
+    double key;
+    uint64_t timestamp;
+    uint64_t geohash;               //packed, see packGeohash()
+};
+
+struct top_events {
+    int count;
+    double floor;                   //-INFINITY until count reaches K
+    struct extreme_event heap[TOP_MAX];     //min-heap, the weakest event first
+};
+
+struct state_extremes {
+    struct top_events hottest;
+    struct top_events coldest;
+};
+
+/* Records are accumulated a batch at a time. Parsed values are first
+ * written to column buffers; accumulateColumns() then reduces each run of
+ * same-state records with plain loops over those columns. */
+#define BATCH_RECORDS 4096
+
+/* A set of records as parallel columns. order[] is each record's position
+ * in the table's states[], slot[] its state code key. */
+struct record_columns {
+    int count;
+    const short *order;
+    const short *slot;
+    const uint64_t *timestamp;
+    const uint64_t *geohash;
+    const double *humidity;
+    const double *cloud;
+    const double *pressure;
+    const double *temperature;
+    const int32_t *snow;
+    const int32_t *lightning;
+    const double *extra[TDV_EXTRA_SLOTS];
+};
+
+/* Column storage for records parsed from text, waiting to be accumulated. */
+struct record_batch {
+    int count;
+    short order[BATCH_RECORDS];
+    short slot[BATCH_RECORDS];
+    uint64_t timestamp[BATCH_RECORDS];
+    uint64_t geohash[BATCH_RECORDS];
+    double humidity[BATCH_RECORDS];
+    double cloud[BATCH_RECORDS];
+    double pressure[BATCH_RECORDS];
+    double temperature[BATCH_RECORDS];
+    int32_t snow[BATCH_RECORDS];
+    int32_t lightning[BATCH_RECORDS];
+    double extra[TDV_EXTRA_SLOTS][BATCH_RECORDS];
+};
+
+/* --stats instrumentation. Build with -DCLIMATE_STATS=0 to compile every
+ * counter and timer out; otherwise they cost one predictable branch each
+ * unless --stats is given. Each table (so each worker) keeps its own
+ * counters. Coarse phases are timed by switching the current phase, which
+ * reads the wall and thread CPU clocks; numeric parsing and state lookup
+ * run per record, so they are timed in cheap ticks and subtracted from the
+ * scan phase to give the tokenizing time. */
+#ifndef CLIMATE_STATS
+#define CLIMATE_STATS 1
+#endif
+
+enum stats_phase { PHASE_OTHER, PHASE_IO, PHASE_SCAN, PHASE_ACCUMULATE, PHASE_MERGE, PHASE_REPORT, NUM_PHASES };
+
+struct run_stats {
+    unsigned long long bytes;
+    unsigned long long lines;
+    unsigned long long records;
+    unsigned long long malformed;
+    unsigned long long filtered;            //records dropped by the record filters
+    unsigned long long chunks;              //-j ingest chunks analyzed
+    unsigned long long steals;              //chunks taken from another worker's queue
+    unsigned long long remote_steals;       //of those, taken from a worker on another node
+    unsigned long long blocks_skipped;      //cache blocks outside the filters
+    unsigned long long zones_skipped;       //zone-mapped text zones outside the filters
+    unsigned long long state_misses;
+    unsigned long long wall[NUM_PHASES];    //ns
+    unsigned long long cpu[NUM_PHASES];     //ns of thread CPU time
+    unsigned long long parse_ticks;
+    unsigned long long lookup_ticks;
+    int phase;
+    int started;
+    unsigned long long wall_since;
+    unsigned long long cpu_since;
+};
+
+/* The states of one -j ingest chunk in the order of their first record in
+ * it. Workers analyze chunks out of order, so this is what puts the states
+ * back in input order when their tables are merged. noted[] is indexed by
+ * the worker table's state order. */
+struct chunk_states {
+    int count;
+    unsigned char noted[NUM_STATES];
+    char codes[NUM_STATES][3];
+};
+
+/* The per-state records of one run (or one worker). The records are one
+ * contiguous array carved from the table's arena, so reports and merges
+ * walk them in order. slot[] maps a state code to its position in states[]
+ * so every lookup is a single load; states[] keeps the order in which the
+ * states were first seen. */
+struct climate_table {
+    struct arena arena;
+    struct climate_info *states;
+    short slot[STATE_CODE_SLOTS];
+    int num_states;
+    struct geo_table geo;
+    struct time_series *rollups;    //parallel to states[] when rolling up
+    struct state_digests *digests;  //parallel to states[] with --percentiles
+    struct state_extremes *extremes;    //parallel to states[] with --top
+    struct record_batch *batch;     //parsed records not yet accumulated
+    struct shared_table *shared;    //--shared workers add cells and buckets here
+    struct chunk_states *first_seen;    //-j workers note the current chunk's states here
+    struct zone_entry *zone;            //--index: the zone being read notes its records here
+    unsigned long long rejected;    //malformed lines skipped, and records past the rollup span
+    struct run_stats stats;
+};
+
+enum report_format { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON, FORMAT_BINARY };
+
+/* Longest --geohash-prefix; packGeohash() keeps at most 12 characters. */
+#define GEOHASH_PREFIX_MAX 12
+
+/* --hugepages backs arena blocks, stream buffers and --shared tables with
+ * 2 MB pages: transparent ones through madvise(), or with =explicit pages
+ * from the reserved hugetlb pool, falling back to transparent ones once
+ * the pool is empty. */
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+enum huge_pages { HUGEPAGES_NONE, HUGEPAGES_TRANSPARENT, HUGEPAGES_EXPLICIT };
+
+/* Settings that apply to the whole run. They are set once in main() before
+ * any input is read, so worker threads only ever read them. */
+static struct {
+    int geohash_precision;          //0 = no per-geohash aggregation
+    enum rollup_unit rollup;
+    int percentiles;
+    int top;                        //--top K, 0 = no extreme-event tracking
+    int stats;
+    int shared;                     //--shared: one cell/bucket table for all workers
+    enum huge_pages hugepages;
+    int numa;                       //--numa: pin -j workers to the nodes of their chunks
+    FILE *rejects;                  //--rejects: malformed lines are copied here
+    enum report_format format;
+    int filtering;                  //any of the record filters below is set
+    int filter_states;
+    unsigned char state_wanted[STATE_CODE_SLOTS];   //--states, by slot
+    unsigned long long from;        //--from/--to: keep from <= timestamp < to
+    unsigned long long to;
+    int filter_temperature;
+    double min_temperature;         //--min-temp/--max-temp, in Kelvin: keep min <= temperature <= max
+    double max_temperature;
+    char geohash_prefix[GEOHASH_PREFIX_MAX + 1];    //--geohash-prefix
+    int prefix_len;
+    uint64_t prefix_bits;           //the prefix packed like packGeohash(), without the length
+    size_t index_bytes;             //--index: zone size of new zone maps, 0 = none are built
+} options = { .to = ULLONG_MAX, .min_temperature = -INFINITY, .max_temperature = INFINITY };
+
+#if CLIMATE_STATS
+static int statsSwitch(struct run_stats *stats, int phase);
+static unsigned long long statsTicks(void);
+#define STATS_COUNT(counters, field, n) do { if (options.stats) { (counters)->field += (n); } } while (0)
+#define STATS_ENTER(counters, phase, prev) int prev = options.stats ? statsSwitch((counters), (phase)) : 0
+#define STATS_LEAVE(counters, prev) do { if (options.stats) { statsSwitch((counters), (prev)); } } while (0)
+#define STATS_TICK(var) unsigned long long var = options.stats ? statsTicks() : 0
+#define STATS_TOCK(counters, field, var) do { if (options.stats) { (counters)->field += statsTicks() - (var); } } while (0)
+#else
+#define STATS_COUNT(counters, field, n) ((void)(counters))
+#define STATS_ENTER(counters, phase, prev) ((void)(counters))
+#define STATS_LEAVE(counters, prev) ((void)(counters))
+#define STATS_TICK(var) ((void)0)
+#define STATS_TOCK(counters, field, var) ((void)(counters))
+#endif
+
+/* One parsed TDV line. */
+struct tdv_record {
+    char code[3];
+    unsigned long long timestamp;
+    double humidity;
+    int snow;
+    double cloud;
+    int lightning;
+    double pressure;
+    double temperature;
+    uint64_t geohash;       //see packGeohash()
+    double extra[TDV_EXTRA_SLOTS];
+};
+
+/* The EXTRA columns' names and labels, by TDV_EXTRA_<name>. */
+#define TDV_EXTRA_COLUMN(name, kind, label) TDV_IF_##kind({ #name, label },)
+static const struct {
+    const char *name;
+    const char *label;
+} extraColumns[TDV_NUM_EXTRAS + 1] = { TDV_COLUMNS(TDV_EXTRA_COLUMN) { NULL, NULL } };
+
+/* Caches and snapshots record a hash of the column list, so files written
+ * by a build for another layout are not read as this one. */
+#define TDV_COLUMN_TEXT(name, kind, label) #name " " #kind ","
+
+static uint32_t schemaId(void)
+{
+    const char *text = TDV_COLUMNS(TDV_COLUMN_TEXT);
+    uint32_t hash = 2166136261u;        //FNV-1a
+    while (*text != '\0')
+    {
+        hash = (hash ^ (unsigned char)*text++) * 16777619u;
+    }
+    return hash;
+}
+
+/* Binary cache files (--build-cache) hold the records of one TDV file as
+ * blocks of columns. Values are stored in host byte order. */
+#define CACHE_MAGIC "CLIMCACH"
+#define CACHE_VERSION 4
+#define CACHE_SUFFIX ".cache"
+#define CACHE_BLOCK_RECORDS 65536
+#define CACHE_MAX_CODES 256
+
+/* Files named on the command line are opened and read ahead by a
+ * prefetch thread while earlier ones are analyzed. It stays at most
+ * PREFETCH_FILES files and PREFETCH_BYTES bytes ahead of main(), reading
+ * PREFETCH_CHUNK bytes at a time into the page cache. */
+#define PREFETCH_FILES 4
+#define PREFETCH_BYTES ((size_t)256 << 20)
+#define PREFETCH_CHUNK ((size_t)4 << 20)
+
+/* Snapshot files (--save-snapshot) hold an aggregated table so later runs
+ * can merge new input into it instead of re-reading everything, and so
+ * --merge can combine the partial tables of several hosts. After the states
+ * come, as flagged, each state's percentile sketches, each state's rollup
+ * buckets, the geohash cells and each state's extreme events. */
+#define SNAPSHOT_MAGIC "CLIMSNAP"
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_DIGESTS 1          //flags: per-state percentile sketches follow the states
+#define SNAPSHOT_ROLLUPS 2          //per-state rollup buckets, in rollup_unit
+#define SNAPSHOT_CELLS 4            //geohash cells, at geohash_precision
+#define SNAPSHOT_TOP 8              //per-state hottest and coldest readings
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_records;
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t num_records;
+    uint32_t num_blocks;
+    uint32_t num_codes;
+    uint32_t schema;                    //schemaId() of the build that wrote it
+    char codes[CACHE_MAX_CODES][2];     //state index -> state code
+};
+
+/* Every cache block starts with this index, so filtered runs can skip a
+ * block without touching its columns. */
+struct cache_block {
+    uint64_t count;
+    uint64_t min_timestamp;
+    uint64_t max_timestamp;
+    uint64_t states[CACHE_MAX_CODES / 64];      //bit i set: state index i occurs
+};
+
+/* --index writes a zone map beside a plain TDV file while reading it: the
+ * file is cut into newline-aligned zones of about --index=MB megabytes, and
+ * each zone's offset, record count, state codes and timestamp and
+ * temperature ranges are noted. Later runs that find a current zone map
+ * skip the zones their filters exclude, and -j takes the zones as its
+ * chunks. */
+#define ZONE_MAGIC "CLIMZMAP"
+#define ZONE_VERSION 1
+#define ZONE_SUFFIX ".zmap"
+#define ZONE_DEFAULT_MB 4
+#define ZONE_OTHER_STATE STATE_CODE_SLOTS          //the bit for codes outside AA-ZZ
+#define ZONE_STATE_WORDS (STATE_CODE_SLOTS / 64 + 1)
+
+struct zone_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t zone_bytes;
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t num_zones;
+};
+
+struct zone_entry {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t records;
+    uint64_t min_timestamp;
+    uint64_t max_timestamp;
+    double minTemp;
+    double maxTemp;
+    uint64_t states[ZONE_STATE_WORDS];      //bit i set: a code with slot i occurs
+};
+
+/* The zone map of the file at path. building is set while a new one is
+ * filled in by the read. */
+struct zone_map {
+    const char *path;
+    struct zone_header header;
+    struct zone_entry *zones;
+    int building;
+};
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_states;
+    uint32_t flags;
+    uint32_t schema;                    //schemaId() of the build that wrote it
+    uint32_t rollup_unit;               //with SNAPSHOT_ROLLUPS
+    uint32_t geohash_precision;         //with SNAPSHOT_CELLS
+};
+
+/* One climate_info as stored in a snapshot file, followed by the sum and
+ * error of each EXTRA column. */
+struct snapshot_state {
+    char code[4];
+    uint32_t num_records;
+    int32_t lightning;
+    int32_t snow;
+    double avgHumidity;
+    double temperature;
+    double cloud;
+    double pressure;
+    double maxTemp;
+    double minTemp;
+    uint64_t maxTempTimestamp;
+    uint64_t minTempTimestamp;
+    double humidityError;
+    double temperatureError;
+    double cloudError;
+    double pressureError;
+};
+
+/* A geohash cell or a rollup bucket as stored in a snapshot file. key is
+ * the cell key (see geoCellKey()) or the bucket number. Each state's
+ * buckets, and the cells, are a uint64_t count followed by the groups. */
+struct snapshot_group {
+    int64_t key;
+    uint32_t num_records;
+    int32_t lightning;
+    double temperature;
+    double humidity;
+    double minTemp;
+    double maxTemp;
+};
+
+/* An extreme event as stored in a snapshot file. Each state's hottest and
+ * then its coldest readings are a uint64_t count followed by the events;
+ * the coldest are keyed by minus the temperature. */
+struct snapshot_event {
+    double key;
+    uint64_t timestamp;
+    uint64_t geohash;
+};
+
+/* A compressed digest as stored in a snapshot file; num_centroids
+ * centroids follow it. */
+struct snapshot_digest {
+    double total;
+    double min;
+    double max;
+    uint32_t num_centroids;
+    uint32_t reserved;
 };
 
-void analyze_file(FILE *file, struct climate_info *states[], int num_states);
-void print_report(struct climate_info *states[], int num_states);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_release(struct arena *arena);
+void init_table(struct climate_table *table);
+void free_table(struct climate_table *table);
+void analyze_file(FILE *file, struct climate_table *table);
+void analyze_buffer(const char *data, size_t len, struct climate_table *table);
+int analyze_mapped(int fd, size_t size, const char *path, struct climate_table *table);
+int analyze_compressed(const char *data, size_t size, int num_threads, struct climate_table *table);
+void analyze_parallel(const char *data[], const size_t sizes[], struct zone_map zones[], int num_files,
+                      int num_threads, struct climate_table *table);
+int analyze_sampled(const char *paths[], const char *data[], const size_t sizes[], int num_files, double rate,
+                    long long budget_ms, struct climate_table *table);
+void merge_states(struct climate_table *dst, const struct climate_table *src);
+int build_cache(const char *path);
+int analyze_cached(const char *path, const struct stat *source, struct climate_table *table);
+int load_cache(const char *data, size_t size, struct climate_table *table);
+int open_zone_map(const char *path, const struct stat *source, const char *data, size_t size, struct zone_map *map);
+int finish_zone_map(struct zone_map *map);
+int save_snapshot(const char *path, const struct climate_table *table);
+int load_snapshot(const char *path, struct climate_table *table);
+int merge_partials(char *const paths[], int num_paths, int num_threads, struct climate_table *table);
+void print_report(const struct climate_table *table);
+void write_report(FILE *out, const struct climate_table *table, enum report_format format);
+void print_stats(struct climate_table *table);
+struct prefetcher *start_prefetch(char *const paths[], int num_paths);
+int prefetch_take(struct prefetcher *prefetch, int n, struct stat *st, int *regular);
+void finish_prefetch(struct prefetcher *prefetch);
+int parse_state_filter(const char *list);
+int parse_timestamp(const char *text, unsigned long long *timestamp);
+int parse_temperature(const char *text, double *kelvin);
+int parse_geohash_prefix(const char *prefix);
+int serve_table(const char *dir, const char *socket_path, struct climate_table *table);
+int query_server(const char *socket_path, enum report_format format);
+
+#ifndef CLIMATE_BENCH
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-j threads [--shared] [--numa]] [--hugepages[=explicit]] [--build-cache]\n"
+            "       [--snapshot file] [--load-snapshot file] [--save-snapshot file] [--geohash precision]\n"
+            "       [--rollup hour|day|month] [--percentiles] [--top K] [--stats] [--rejects file]\n"
+            "       [--format text|csv|json|binary] [--no-prefetch]\n"
+            "       [--states XX,YY,...] [--from time] [--to time] [--geohash-prefix prefix]\n"
+            "       [--min-temp F] [--max-temp F] [--index[=MB]] [--sample rate] [--time-budget ms]\n"
+            "       [--serve dir --socket path] tdv_file1 tdv_file2 ... tdv_fileN (- reads stdin)\n"
+            "       %s --merge [-j threads] [report options] partial1 ... partialN\n"
+            "       %s --query path [--format text|csv|json|binary]\n", prog, prog, prog);
+}
 
 int main(int argc, char *argv[]) {
-    
-    /* TODO: fix this conditional. You should be able to read multiple files. */
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s tdv_file1 tdv_file2 ... tdv_fileN \n", argv[0]);
+
+    enum { OPT_BUILD_CACHE = 256, OPT_SNAPSHOT, OPT_LOAD_SNAPSHOT, OPT_SAVE_SNAPSHOT, OPT_GEOHASH, OPT_ROLLUP, OPT_PERCENTILES, OPT_STATS, OPT_REJECTS, OPT_FORMAT, OPT_NO_PREFETCH,
+           OPT_STATES, OPT_FROM, OPT_TO, OPT_GEOHASH_PREFIX, OPT_SERVE, OPT_SOCKET, OPT_QUERY, OPT_SHARED,
+           OPT_HUGEPAGES, OPT_NUMA, OPT_MERGE, OPT_TOP, OPT_SAMPLE, OPT_TIME_BUDGET,
+           OPT_MIN_TEMP, OPT_MAX_TEMP, OPT_INDEX };
+    static const struct option long_options[] = {
+        { "jobs", required_argument, NULL, 'j' },
+        { "build-cache", no_argument, NULL, OPT_BUILD_CACHE },
+        { "snapshot", required_argument, NULL, OPT_SNAPSHOT },
+        { "load-snapshot", required_argument, NULL, OPT_LOAD_SNAPSHOT },
+        { "save-snapshot", required_argument, NULL, OPT_SAVE_SNAPSHOT },
+        { "geohash", required_argument, NULL, OPT_GEOHASH },
+        { "rollup", required_argument, NULL, OPT_ROLLUP },
+        { "percentiles", no_argument, NULL, OPT_PERCENTILES },
+        { "stats", no_argument, NULL, OPT_STATS },
+        { "rejects", required_argument, NULL, OPT_REJECTS },
+        { "format", required_argument, NULL, OPT_FORMAT },
+        { "no-prefetch", no_argument, NULL, OPT_NO_PREFETCH },
+        { "states", required_argument, NULL, OPT_STATES },
+        { "from", required_argument, NULL, OPT_FROM },
+        { "to", required_argument, NULL, OPT_TO },
+        { "geohash-prefix", required_argument, NULL, OPT_GEOHASH_PREFIX },
+        { "serve", required_argument, NULL, OPT_SERVE },
+        { "socket", required_argument, NULL, OPT_SOCKET },
+        { "query", required_argument, NULL, OPT_QUERY },
+        { "shared", no_argument, NULL, OPT_SHARED },
+        { "hugepages", optional_argument, NULL, OPT_HUGEPAGES },
+        { "numa", no_argument, NULL, OPT_NUMA },
+        { "merge", no_argument, NULL, OPT_MERGE },
+        { "top", required_argument, NULL, OPT_TOP },
+        { "sample", required_argument, NULL, OPT_SAMPLE },
+        { "time-budget", required_argument, NULL, OPT_TIME_BUDGET },
+        { "min-temp", required_argument, NULL, OPT_MIN_TEMP },
+        { "max-temp", required_argument, NULL, OPT_MAX_TEMP },
+        { "index", optional_argument, NULL, OPT_INDEX },
+        { NULL, 0, NULL, 0 }
+    };
+    int num_threads = 1;
+    int building_cache = 0;
+    const char *load_path = NULL;
+    const char *save_path = NULL;
+    int load_optional = 0;      //--snapshot tolerates a missing file on the first run
+    int prefetching = 1;
+    const char *serve_dir = NULL;
+    const char *socket_path = NULL;
+    const char *query_path = NULL;
+    int merging = 0;
+    double sample_rate = 1;
+    long long time_budget = 0;
+    int sampling = 0;           //--sample or --time-budget: estimate from part of the input
+    int zone_mb;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            num_threads = atoi(optarg);
+            if (num_threads < 1) {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_BUILD_CACHE:
+            building_cache = 1;
+            break;
+        case OPT_SNAPSHOT:
+            load_path = save_path = optarg;
+            load_optional = 1;
+            break;
+        case OPT_LOAD_SNAPSHOT:
+            load_path = optarg;
+            load_optional = 0;
+            break;
+        case OPT_SAVE_SNAPSHOT:
+            save_path = optarg;
+            break;
+        case OPT_GEOHASH:
+            options.geohash_precision = atoi(optarg);
+            if (options.geohash_precision < 1 || options.geohash_precision > GEOHASH_MAX_PRECISION) {
+                fprintf(stderr, "Geohash precision must be 1-%d: %s\n", GEOHASH_MAX_PRECISION, optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_ROLLUP:
+            if (strcmp(optarg, "hour") == 0) {
+                options.rollup = ROLLUP_HOUR;
+            } else if (strcmp(optarg, "day") == 0) {
+                options.rollup = ROLLUP_DAY;
+            } else if (strcmp(optarg, "month") == 0) {
+                options.rollup = ROLLUP_MONTH;
+            } else {
+                fprintf(stderr, "Rollup must be hour, day or month: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_PERCENTILES:
+            options.percentiles = 1;
+            break;
+        case OPT_TOP:
+            options.top = atoi(optarg);
+            if (options.top < 1 || options.top > TOP_MAX) {
+                fprintf(stderr, "--top must be 1-%d: %s\n", TOP_MAX, optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_STATS:
+#if CLIMATE_STATS
+            options.stats = 1;
+#else
+            fprintf(stderr, "This build has no --stats support (CLIMATE_STATS=0)\n");
+#endif
+            break;
+        case OPT_FORMAT:
+            if (strcmp(optarg, "text") == 0) {
+                options.format = FORMAT_TEXT;
+            } else if (strcmp(optarg, "csv") == 0) {
+                options.format = FORMAT_CSV;
+            } else if (strcmp(optarg, "json") == 0) {
+                options.format = FORMAT_JSON;
+            } else if (strcmp(optarg, "binary") == 0) {
+                options.format = FORMAT_BINARY;
+            } else {
+                fprintf(stderr, "Format must be text, csv, json or binary: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_NO_PREFETCH:
+            prefetching = 0;
+            break;
+        case OPT_STATES:
+            if (parse_state_filter(optarg) != 0) {
+                fprintf(stderr, "States must be a comma-separated list of two-letter codes: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_FROM:
+        case OPT_TO:
+            if (parse_timestamp(optarg, opt == OPT_FROM ? &options.from : &options.to) != 0) {
+                fprintf(stderr, "Times are milliseconds since the epoch or YYYY-MM[-DD[THH:MM[:SS]]] (UTC): %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            options.filtering = 1;
+            break;
+        case OPT_MIN_TEMP:
+        case OPT_MAX_TEMP:
+            if (parse_temperature(optarg, opt == OPT_MIN_TEMP ? &options.min_temperature : &options.max_temperature) != 0) {
+                fprintf(stderr, "Temperatures are degrees Fahrenheit: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            options.filter_temperature = 1;
+            options.filtering = 1;
+            break;
+        case OPT_INDEX:
+            zone_mb = optarg != NULL ? atoi(optarg) : ZONE_DEFAULT_MB;
+            if (zone_mb < 1 || zone_mb > 1024) {
+                fprintf(stderr, "Zone size must be 1-1024 MB: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            options.index_bytes = (size_t)zone_mb << 20;
+            break;
+        case OPT_SHARED:
+            options.shared = 1;
+            break;
+        case OPT_HUGEPAGES:
+            if (optarg == NULL || strcmp(optarg, "transparent") == 0) {
+                options.hugepages = HUGEPAGES_TRANSPARENT;
+            } else if (strcmp(optarg, "explicit") == 0) {
+                options.hugepages = HUGEPAGES_EXPLICIT;
+            } else {
+                fprintf(stderr, "Huge pages must be transparent or explicit: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_NUMA:
+            options.numa = 1;
+            break;
+        case OPT_MERGE:
+            merging = 1;
+            break;
+        case OPT_SAMPLE:
+            sample_rate = atof(optarg);
+            if (!(sample_rate > 0 && sample_rate <= 1)) {
+                fprintf(stderr, "Sample rate must be more than 0 and at most 1: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            sampling = 1;
+            break;
+        case OPT_TIME_BUDGET:
+            time_budget = atoll(optarg);
+            if (time_budget < 1) {
+                fprintf(stderr, "Invalid time budget: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            sampling = 1;
+            break;
+        case OPT_SERVE:
+            serve_dir = optarg;
+            break;
+        case OPT_SOCKET:
+            socket_path = optarg;
+            break;
+        case OPT_QUERY:
+            query_path = optarg;
+            break;
+        case OPT_GEOHASH_PREFIX:
+            if (parse_geohash_prefix(optarg) != 0) {
+                fprintf(stderr, "Geohash prefix must be 1-%d geohash characters: %s\n", GEOHASH_PREFIX_MAX, optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_REJECTS:
+            if (options.rejects != NULL) {
+                fclose(options.rejects);
+            }
+            options.rejects = fopen(optarg, "w");
+            if (options.rejects == NULL) {
+                fprintf(stderr, "Could not open %s for writing.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* --query only asks a running --serve for its report. */
+    if (query_path != NULL) {
+        if (query_server(query_path, options.format) != 0) {
+            fprintf(stderr, "Could not query the server on %s\n", query_path);
+            return EXIT_FAILURE;
+        }
+        return 0;
+    }
+    if ((serve_dir == NULL) != (socket_path == NULL) || (serve_dir != NULL && building_cache)
+        || (merging && (building_cache || serve_dir != NULL || optind >= argc))
+        || (sampling && (building_cache || serve_dir != NULL || merging || load_path != NULL || save_path != NULL
+                         || optind >= argc))) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (sampling && options.format != FORMAT_TEXT) {
+        fprintf(stderr, "--sample and --time-budget print text estimates only\n");
+        return EXIT_FAILURE;
+    }
+
+    /* With no file arguments, read a piped stdin (zcat data.tdv.gz | climate).
+     * A snapshot on its own is enough to print a report; pass - to merge
+     * stdin into it. A server may start with nothing at all. */
+    int read_stdin = optind >= argc && !isatty(STDIN_FILENO) && !building_cache && load_path == NULL
+        && serve_dir == NULL;
+    if (optind >= argc && !read_stdin && (load_path == NULL || building_cache) && serve_dir == NULL) {
+        usage(argv[0]);
         return EXIT_FAILURE;
     }
+
+    /* --build-cache only converts the inputs; the report comes from later
+     * runs, which pick the caches up automatically. */
+    if (building_cache) {
+        int status = EXIT_SUCCESS;
+        int i;
+        for (i = optind; i < argc; ++i) {
+            if (build_cache(argv[i]) != 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+        return status;
+    }
     
-    /* Let's create an array to store our state data in. As we know, there are
+    /* Let's create a table to store our state data in. As we know, there are
      * 50 US states. */
-    struct climate_info *states[NUM_STATES] = { NULL };
+    struct climate_table table;
+    init_table(&table);
     FILE *file;
+    struct stat st;
     int i;
-    for (i = 1; i < argc; ++i) {
+
+    /* With -j, mapped files are collected here and analyzed together once
+     * every argument has been opened. */
+    const char **mapped_data = calloc((size_t)argc, sizeof(*mapped_data));
+    size_t *mapped_sizes = calloc((size_t)argc, sizeof(*mapped_sizes));
+    const char **sample_paths = calloc((size_t)argc, sizeof(*sample_paths));
+    struct zone_map *mapped_zones = calloc((size_t)argc, sizeof(*mapped_zones));
+    int num_mapped = 0;
+
+    /* Earlier totals come first, so states keep the order they had then. */
+    if (load_path != NULL && load_snapshot(load_path, &table) != 0) {
+        if (!load_optional || access(load_path, F_OK) == 0) {
+            fprintf(stderr, "Could not load snapshot %s\n", load_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (read_stdin) {
+        analyze_file(stdin, &table);
+    }
+
+    /* --merge reads partial tables from other runs instead of TDV files. */
+    if (merging) {
+        if (merge_partials(argv + optind, argc - optind, num_threads, &table) != 0) {
+            free_table(&table);
+            return EXIT_FAILURE;
+        }
+        optind = argc;
+    }
+
+    /* With more than one file, the next ones are opened and read ahead
+     * while the current one is analyzed. --numa leaves the reading to the
+     * -j workers, so each chunk's pages are placed on its worker's node. */
+    struct prefetcher *prefetch = NULL;
+    if (prefetching && argc - optind > 1 && !(options.numa && num_threads > 1) && !sampling) {
+        prefetch = start_prefetch(argv + optind, argc - optind);
+    }
+
+    for (i = optind; i < argc; ++i) {
+        /* Regular files are mapped and scanned in place; anything else (pipes,
+         * character devices) goes through the stdio path below. */
+        STATS_ENTER(&table.stats, PHASE_IO, prev);
+        int fd = -1, regular = 0;
+        if (prefetch != NULL) {
+            fd = prefetch_take(prefetch, i - optind, &st, &regular);
+        } else if (strcmp(argv[i], "-") != 0) {
+            fd = open(argv[i], O_RDONLY);
+            regular = fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        }
+        STATS_LEAVE(&table.stats, prev);
+
+        if (strcmp(argv[i], "-") == 0 && !sampling) {
+            analyze_file(stdin, &table);
+            continue;
+        }
+        /* Sampling needs to seek, so it only reads plain text files. */
+        if (sampling) {
+            void *data = regular && st.st_size > 0
+                ? mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+            if (fd != -1) {
+                close(fd);
+            }
+            if (regular && st.st_size == 0) {
+                continue;
+            }
+            if (data == MAP_FAILED) {
+                fprintf(stderr, "Cannot sample %s: only regular files can be sampled\n", argv[i]);
+                free_table(&table);
+                return EXIT_FAILURE;
+            }
+            sample_paths[num_mapped] = argv[i];
+            mapped_data[num_mapped] = data;
+            mapped_sizes[num_mapped++] = (size_t)st.st_size;
+            continue;
+        }
+        if (regular) {
+            int mapped = -1;
+            if (analyze_cached(argv[i], &st, &table) == 0) {
+                mapped = 0;
+            } else if (num_threads == 1) {
+                mapped = analyze_mapped(fd, (size_t)st.st_size, argv[i], &table);
+            } else if (st.st_size == 0) {
+                mapped = 0;
+            } else {
+                STATS_ENTER(&table.stats, PHASE_IO, prev_io);
+                void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                STATS_LEAVE(&table.stats, prev_io);
+                if (data != MAP_FAILED && (load_cache(data, (size_t)st.st_size, &table) == 0
+                        || analyze_compressed(data, (size_t)st.st_size, num_threads, &table))) {
+                    munmap(data, (size_t)st.st_size);
+                    mapped = 0;
+                } else if (data != MAP_FAILED) {
+                    struct zone_map *zones = &mapped_zones[num_mapped];
+                    int skipping = open_zone_map(argv[i], &st, data, (size_t)st.st_size, zones) == 0
+                        && !zones->building && options.filtering;
+                    //with --numa each worker reads its own chunks in, so their pages land on its node
+                    if (!options.numa && !skipping) {
+                        madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+                    }
+                    if (options.hugepages != HUGEPAGES_NONE) {
+                        madvise(data, (size_t)st.st_size, MADV_HUGEPAGE);
+                    }
+                    mapped_data[num_mapped] = data;
+                    mapped_sizes[num_mapped++] = (size_t)st.st_size;
+                    mapped = 0;
+                }
+            }
+            close(fd);
+            if (mapped == 0) {
+                continue;
+            }
+        } else if (fd != -1) {
+            close(fd);
+        }
+
         /* TODO: Open the file for reading */
         file = fopen(argv[i], "r");
 
@@ -110,166 +1150,6672 @@ int main(int argc, char *argv[]) {
         }
 
         /* TODO: Analyze the file */
-        analyze_file(file, states, NUM_STATES);
+        analyze_file(file, &table);
         fclose(file);
     }
 
+    if (prefetch != NULL) {
+        finish_prefetch(prefetch);
+    }
+
+    int estimated = 0;
+    if (sampling && num_mapped > 0) {
+        int complete = analyze_sampled(sample_paths, mapped_data, mapped_sizes, num_mapped, sample_rate, time_budget,
+                                       &table);
+        for (i = 0; i < num_mapped; ++i) {
+            munmap((void *)mapped_data[i], mapped_sizes[i]);
+        }
+        if (complete < 0) {
+            free_table(&table);
+            return EXIT_FAILURE;
+        }
+        estimated = !complete;
+    } else if (num_mapped > 0) {
+        analyze_parallel(mapped_data, mapped_sizes, mapped_zones, num_mapped, num_threads, &table);
+        for (i = 0; i < num_mapped; ++i) {
+            finish_zone_map(&mapped_zones[i]);
+            munmap((void *)mapped_data[i], mapped_sizes[i]);
+        }
+    }
+    free(mapped_data);
+    free(mapped_sizes);
+    free(sample_paths);
+    free(mapped_zones);
+
+    /* The server reports over its socket; a snapshot saved on shutdown
+     * carries everything it read. */
+    int serve_status = 0;
+    if (serve_dir != NULL) {
+        serve_status = serve_table(serve_dir, socket_path, &table);
+    }
+
+    if (save_path != NULL && save_snapshot(save_path, &table) != 0) {
+        fprintf(stderr, "Could not save snapshot %s\n", save_path);
+        free_table(&table);
+        return EXIT_FAILURE;
+    }
+    if (serve_dir != NULL) {
+        free_table(&table);
+        return serve_status == 0 ? 0 : EXIT_FAILURE;
+    }
+
     /* Now that we have recorded data for each file, we'll summarize them: */
-    print_report(states, NUM_STATES);
+    STATS_ENTER(&table.stats, PHASE_REPORT, prev);
+    if (!estimated) {
+        print_report(&table);
+    }
+    STATS_LEAVE(&table.stats, prev);
+    if (table.rejected > 0) {
+        fflush(stdout);
+        fprintf(stderr, "Rejected %llu malformed lines\n", table.rejected);
+    }
+    if (options.stats) {
+        fflush(stdout);
+        print_stats(&table);
+    }
+    if (options.rejects != NULL && fclose(options.rejects) != 0) {
+        fprintf(stderr, "Could not write the rejects file\n");
+    }
+    free_table(&table);
 
     return 0;
 }
+#else
 
-/**************************************************
-*Function that counts the number of states found
-**************************************************/
-static int countStates(struct climate_info **states, int num_states)
+/* The benchmark build (make bench) replaces the command line tool with a
+ * harness that times analyze_file() and analyze_mapped() over the given
+ * files and reports throughput. The first pass warms the page cache and
+ * is not counted. */
+#define BENCH_DEFAULT_RUNS 5
+
+static double benchSeconds(void)
 {
-    int num = 0;
-    while(num < num_states && states[num] != NULL)
-    {
-        num++;
-    }
-    return num;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int compareSeconds(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
 }
 
 /**************************************************
-*Function that checks for the order of the states
+*Runs one pass over every file, streamed (mapped == 0)
+*or mapped. Returns the elapsed seconds and stores the
+*record count.
 **************************************************/
-static int compareOrder(struct climate_info **states, char codex[3], int currentStates)//returns the order of each state in the array
+static double benchPass(char *paths[], int num_paths, int mapped, unsigned long long *records)
 {
-    int order = 0;
-    while (order < currentStates)   //while order is less than number of states analyzed
+    struct climate_table table;
+    int i;
+    init_table(&table);
+    double start = benchSeconds();
+    for (i = 0; i < num_paths; i++)
     {
-        if (states[order] == NULL)
+        if (mapped)
         {
-            break;
+            struct stat st;
+            int fd = open(paths[i], O_RDONLY);
+            if (fd != -1 && fstat(fd, &st) == 0)
+            {
+                analyze_mapped(fd, (size_t)st.st_size, NULL, &table);
+            }
+            if (fd != -1)
+            {
+                close(fd);
+            }
         }
-        if(strcmp((states[order])->code, codex) == 0)       //if the states is present, returns its order
+        else
         {
-            return order;
+            FILE *file = fopen(paths[i], "r");
+            if (file != NULL)
+            {
+                analyze_file(file, &table);
+                fclose(file);
+            }
         }
-        order++;    
     }
-    return -1;        //returns -1 if checked all states and new state isn't present
+    double elapsed = benchSeconds() - start;
+
+    *records = 0;
+    for (i = 0; i < table.num_states; i++)
+    {
+        *records += table.states[i].num_records;
+    }
+    free_table(&table);
+    return elapsed;
 }
 
-/***********************
-*Analyze file function
-************************/
-void analyze_file(FILE *file, struct climate_info **states, int num_states)
+int main(int argc, char *argv[])
 {
-    const int line_sz = 100;
-    char line[line_sz];
-    int currentStates = countStates(states, num_states);
-    
+    static const char *const modeNames[] = { "analyze_file", "analyze_mapped" };
+    int runs = BENCH_DEFAULT_RUNS;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:")) != -1)
+    {
+        if (opt != 'r' || (runs = atoi(optarg)) < 1)
+        {
+            fprintf(stderr, "Usage: %s [-r runs] tdv_file1 ... tdv_fileN\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "Usage: %s [-r runs] tdv_file1 ... tdv_fileN\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    unsigned long long bytes = 0;
+    int i;
+    for (i = optind; i < argc; i++)
+    {
+        struct stat st;
+        if (stat(argv[i], &st) != 0)
+        {
+            fprintf(stderr, "Could not open %s.\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        bytes += (unsigned long long)st.st_size;
+    }
+
+    double *times = malloc((size_t)runs * sizeof(double));
+    int mode;
+    for (mode = 0; mode < 2; mode++)
+    {
+        unsigned long long records;
+        int r;
+        benchPass(argv + optind, argc - optind, mode, &records);
+        for (r = 0; r < runs; r++)
+        {
+            times[r] = benchPass(argv + optind, argc - optind, mode, &records);
+        }
+        qsort(times, (size_t)runs, sizeof(double), compareSeconds);
+        double median = times[runs / 2];
+        printf("%-15s %llu records, %.1f MB, %d runs: best %.3fs, median %.3fs, "
+               "%.2fM records/s, %.1f MB/s\n",
+               modeNames[mode], records, bytes / 1e6, runs, times[0], median,
+               records / median / 1e6, bytes / median / 1e6);
+    }
+    free(times);
+    return 0;
+}
+#endif
+
+static int hugetlbEmpty;     //set once a MAP_HUGETLB mapping has failed
+
+/**************************************************
+*Returns size zeroed bytes, or NULL if out of memory.
+*With --hugepages the memory is mapped on a 2 MB
+*boundary and rounded up to whole huge pages;
+*otherwise it comes from calloc(). Release it with
+*freePages() and the same size.
+**************************************************/
+static void *allocPages(size_t size)
+{
+    if (options.hugepages == HUGEPAGES_NONE)
+    {
+        return calloc(1, size);
+    }
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    if (options.hugepages == HUGEPAGES_EXPLICIT && !__atomic_load_n(&hugetlbEmpty, __ATOMIC_RELAXED))
+    {
+        void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+        if (memory != MAP_FAILED)
+        {
+            return memory;
+        }
+        __atomic_store_n(&hugetlbEmpty, 1, __ATOMIC_RELAXED);
+    }
+
+    //map a page extra and trim it, so the range starts on a huge page boundary
+    char *raw = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+        return NULL;
+    }
+    size_t lead = (HUGE_PAGE_SIZE - ((uintptr_t)raw & (HUGE_PAGE_SIZE - 1))) & (HUGE_PAGE_SIZE - 1);
+    if (lead > 0)
+    {
+        munmap(raw, lead);
+    }
+    munmap(raw + lead + size, HUGE_PAGE_SIZE - lead);
+    madvise(raw + lead, size, MADV_HUGEPAGE);
+    return raw + lead;
+}
+
+static void freePages(void *memory, size_t size)
+{
+    if (options.hugepages == HUGEPAGES_NONE)
+    {
+        free(memory);
+    }
+    else if (memory != NULL)
+    {
+        munmap(memory, (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    }
+}
+
+/**************************************************
+*Returns size zeroed bytes from the arena, aligned to
+*a cache line. Requests larger than a block get a
+*block of their own.
+**************************************************/
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    const size_t header = (sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_block *block = arena->blocks;
+    if (block == NULL || block->size - block->used < size)
+    {
+        size_t block_size = header + size > ARENA_BLOCK_SIZE ? header + size : ARENA_BLOCK_SIZE;
+        void *memory = NULL;
+        if (options.hugepages != HUGEPAGES_NONE)
+        {
+            //a block fills whole huge pages
+            block_size = (block_size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+            memory = allocPages(block_size);
+        }
+        else if (posix_memalign(&memory, ARENA_ALIGN, block_size) == 0)
+        {
+            memset(memory, 0, block_size);
+        }
+        if (memory == NULL)
+        {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        block = memory;
+        block->size = block_size;
+        block->used = header;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    void *result = (char *)block + block->used;
+    block->used += size;
+    return result;
+}
+
+/**************************************************
+*Frees every allocation made from the arena
+**************************************************/
+void arena_release(struct arena *arena)
+{
+    while (arena->blocks != NULL)
+    {
+        struct arena_block *next = arena->blocks->next;
+        freePages(arena->blocks, arena->blocks->size);
+        arena->blocks = next;
+    }
+}
+
+/**************************************************
+*Sets up an empty table with no states
+**************************************************/
+void init_table(struct climate_table *table)
+{
+    table->arena.blocks = NULL;
+    table->states = arena_alloc(&table->arena, NUM_STATES * sizeof(struct climate_info));
+    memset(table->slot, 0xff, sizeof(table->slot));     //every slot starts at -1
+    table->num_states = 0;
+    memset(&table->geo, 0, sizeof(table->geo));
+    table->rollups = NULL;
+    if (options.rollup != ROLLUP_NONE)
+    {
+        table->rollups = arena_alloc(&table->arena, NUM_STATES * sizeof(struct time_series));
+    }
+    table->digests = NULL;
+    if (options.percentiles)
+    {
+        table->digests = arena_alloc(&table->arena, NUM_STATES * sizeof(struct state_digests));
+    }
+    table->extremes = NULL;
+    if (options.top > 0)
+    {
+        int i;
+        table->extremes = arena_alloc(&table->arena, NUM_STATES * sizeof(struct state_extremes));
+        for (i = 0; i < NUM_STATES; i++)
+        {
+            table->extremes[i].hottest.floor = -INFINITY;
+            table->extremes[i].coldest.floor = -INFINITY;
+        }
+    }
+    table->batch = arena_alloc(&table->arena, sizeof(struct record_batch));
+    table->shared = NULL;
+    table->first_seen = NULL;
+    table->zone = NULL;
+    table->rejected = 0;
+    memset(&table->stats, 0, sizeof(table->stats));
+}
+
+/**************************************************
+*Releases the records owned by a table
+**************************************************/
+void free_table(struct climate_table *table)
+{
+    arena_release(&table->arena);
+    table->states = NULL;
+    table->num_states = 0;
+}
+
+/**************************************************
+*Function that counts the number of states found
+**************************************************/
+static int countStates(const struct climate_table *table)
+{
+    return table->num_states;
+}
+
+/**************************************************
+*Maps a state code to its index in the slot table,
+*or -1 if it is not two uppercase letters
+**************************************************/
+static int stateKey(const char code[3])
+{
+    unsigned int first = (unsigned char)code[0] - 'A';
+    unsigned int second = (unsigned char)code[1] - 'A';
+    if (first >= 26 || second >= 26)
+    {
+        return -1;
+    }
+    return (int)(first * 26 + second);
+}
+
+/**************************************************
+*Function that checks for the order of the states
+**************************************************/
+static int compareOrder(const struct climate_table *table, const char codex[3])//returns the order of each state in the array
+{
+    int key = stateKey(codex);
+    if (key >= 0)
+    {
+        return table->slot[key];
+    }
+
+    int order;
+    for (order = 0; order < table->num_states; order++)     //codes outside A-Z are rare, scan for them
+    {
+        if(strcmp(table->states[order].code, codex) == 0)
+        {
+            return order;
+        }
+    }
+    return -1;        //returns -1 if checked all states and new state isn't present
+}
+
+/**************************************************
+*Allocates a record for a state that is not in the
+*table yet and returns its order
+**************************************************/
+static int addState(struct climate_table *table, const char codex[3])
+{
+    if (table->num_states >= NUM_STATES)
+    {
+        fprintf(stderr, "Error: too many states (There are already %d states, should not add more)\n", table->num_states);
+        exit(EXIT_FAILURE);
+    }
+    int order = table->num_states++;
+    strcpy(table->states[order].code, codex);
+    int key = stateKey(codex);
+    if (key >= 0)
+    {
+        table->slot[key] = (short)order;
+    }
+    return order;
+}
+
+/* Powers of ten that are exact in a double; dividing an exact mantissa by
+ * one of these is correctly rounded, which is what strtod() returns. */
+static const double exactPow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/**************************************************
+*Parses a plain decimal (optional sign, digits and a
+*fraction) at *cursor and moves the cursor past it.
+*Gives the same result as atof(); anything with an
+*exponent or too many digits is handed to strtod().
+**************************************************/
+static double parseDecimal(const char **cursor)
+{
+    const char *start = *cursor;
+    const char *p = start;
+    int negative = 0;
+    while (*p == ' ')
+    {
+        p++;
+    }
+    if (*p == '-' || *p == '+')
+    {
+        negative = (*p == '-');
+        p++;
+    }
+
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int fraction = 0;
+    while ((unsigned char)(*p - '0') < 10)
+    {
+        mantissa = mantissa * 10 + (unsigned long long)(*p++ - '0');
+        digits++;
+    }
+    if (*p == '.')
+    {
+        p++;
+        while ((unsigned char)(*p - '0') < 10)
+        {
+            mantissa = mantissa * 10 + (unsigned long long)(*p++ - '0');
+            digits++;
+            fraction++;
+        }
+    }
+
+    //fall back when the fast path would not be exact
+    if (digits > 19 || mantissa > (1ULL << 53) || fraction > 22 || *p == 'e' || *p == 'E'
+        || (digits == 0 && *p != '\t' && *p != '\n' && *p != '\0'))
+    {
+        char *next;
+        double value = strtod(start, &next);
+        *cursor = next;
+        return value;
+    }
+
+    *cursor = p;
+    double value = (double)mantissa / exactPow10[fraction];
+    return negative ? -value : value;
+}
+
+/**************************************************
+*Parses the integer part of a number at *cursor, the
+*way atoi() does, and moves the cursor past the
+*digits (a fraction such as the ".0" in "1.0" is left
+*for the caller to skip)
+**************************************************/
+static long long parseInteger(const char **cursor)
+{
+    const char *p = *cursor;
+    int negative = 0;
+    while (*p == ' ')
+    {
+        p++;
+    }
+    if (*p == '-' || *p == '+')
+    {
+        negative = (*p == '-');
+        p++;
+    }
+    long long value = 0;
+    while ((unsigned char)(*p - '0') < 10)
+    {
+        value = value * 10 + (*p++ - '0');
+    }
+    *cursor = p;
+    return negative ? -value : value;
+}
+
+/* Geohash base-32 alphabet; -1 marks characters that cannot appear. */
+static const signed char geohashValue[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8,
+    ['8'] = 9, ['9'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15, ['g'] = 16,
+    ['h'] = 17, ['j'] = 18, ['k'] = 19, ['m'] = 20, ['n'] = 21, ['p'] = 22, ['q'] = 23, ['r'] = 24,
+    ['s'] = 25, ['t'] = 26, ['u'] = 27, ['v'] = 28, ['w'] = 29, ['x'] = 30, ['y'] = 31, ['z'] = 32
+};
+static const char geohashAlphabet[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+
+/**************************************************
+*Packs up to 12 geohash characters five bits each,
+*with the number of characters in the top four bits.
+*Packing stops at the first invalid character.
+**************************************************/
+static uint64_t packGeohash(const char *p)
+{
+    uint64_t bits = 0;
+    int len = 0;
+    while (len < 12 && geohashValue[(unsigned char)p[len]] > 0)
+    {
+        bits = (bits << 5) | (uint64_t)(geohashValue[(unsigned char)p[len]] - 1);
+        len++;
+    }
+    return ((uint64_t)len << 60) | bits;
+}
+
+/**************************************************
+*Builds the cell key for a state and packed geohash
+*at the configured precision. Returns 0 (never a
+*valid key) if the geohash is too short.
+**************************************************/
+static uint64_t geoCellKey(int stateSlot, uint64_t geohash)
+{
+    int len = (int)(geohash >> 60);
+    int precision = options.geohash_precision;
+    if (len < precision || stateSlot < 0)
+    {
+        return 0;
+    }
+    uint64_t prefix = (geohash & ((1ULL << 60) - 1)) >> (5 * (len - precision));
+    return ((uint64_t)(stateSlot + 1) << 54) | prefix;
+}
+
+static unsigned int geoHashKey(uint64_t key)
+{
+    key ^= key >> 31;
+    key *= 0x9e3779b97f4a7c15ULL;
+    return (unsigned int)(key >> 32);
+}
+
+static struct geo_cell *geoCellAt(const struct geo_table *geo, unsigned int n)
+{
+    return &geo->pages[n / GEO_PAGE_CELLS][n % GEO_PAGE_CELLS];
+}
+
+/**************************************************
+*Returns the cell for key, creating an empty one if
+*needed. The index is rebuilt at double the size
+*whenever it gets half full.
+**************************************************/
+static struct geo_cell *geoFind(struct climate_table *table, uint64_t key)
+{
+    struct geo_table *geo = &table->geo;
+    if (geo->num_cells * 2 >= geo->index_size)
+    {
+        unsigned int size = geo->index_size == 0 ? 1024 : geo->index_size * 2;
+        uint32_t *index = arena_alloc(&table->arena, size * sizeof(uint32_t));
+        unsigned int n;
+        for (n = 0; n < geo->num_cells; n++)
+        {
+            unsigned int h = geoHashKey(geoCellAt(geo, n)->key) & (size - 1);
+            while (index[h] != 0)
+            {
+                h = (h + 1) & (size - 1);
+            }
+            index[h] = n + 1;
+        }
+        geo->index = index;
+        geo->index_size = size;
+    }
+
+    unsigned int h = geoHashKey(key) & (geo->index_size - 1);
+    while (geo->index[h] != 0)
+    {
+        struct geo_cell *cell = geoCellAt(geo, geo->index[h] - 1);
+        if (cell->key == key)
+        {
+            return cell;
+        }
+        h = (h + 1) & (geo->index_size - 1);
+    }
+
+    if (geo->num_cells == geo->num_pages * GEO_PAGE_CELLS)
+    {
+        if (geo->num_pages == geo->page_capacity)
+        {
+            unsigned int capacity = geo->page_capacity == 0 ? 16 : geo->page_capacity * 2;
+            struct geo_cell **pages = arena_alloc(&table->arena, capacity * sizeof(*pages));
+            if (geo->num_pages > 0)
+            {
+                memcpy(pages, geo->pages, geo->num_pages * sizeof(*pages));
+            }
+            geo->pages = pages;
+            geo->page_capacity = capacity;
+        }
+        geo->pages[geo->num_pages++] = arena_alloc(&table->arena, GEO_PAGE_CELLS * sizeof(struct geo_cell));
+    }
+    unsigned int n = geo->num_cells++;
+    geo->index[h] = n + 1;
+    struct geo_cell *cell = geoCellAt(geo, n);
+    cell->key = key;
+    return cell;
+}
+
+/**************************************************
+*Adds a cell's worth of observations to the cell for
+*key (a single record is a cell with one record)
+**************************************************/
+static void geoMerge(struct climate_table *table, const struct geo_cell *from)
+{
+    struct geo_cell *cell = geoFind(table, from->key);
+    if (cell->num_records == 0 || from->minTemp < cell->minTemp)
+    {
+        cell->minTemp = from->minTemp;
+    }
+    if (cell->num_records == 0 || from->maxTemp > cell->maxTemp)
+    {
+        cell->maxTemp = from->maxTemp;
+    }
+    cell->num_records += from->num_records;
+    cell->lightning += from->lightning;
+    cell->temperature += from->temperature;
+    cell->humidity += from->humidity;
+}
+
+static void geoAccumulate(struct climate_table *table, int stateSlot, const struct tdv_record *rec)
+{
+    struct geo_cell one;
+    one.key = geoCellKey(stateSlot, rec->geohash);
+    if (one.key == 0)
+    {
+        return;
+    }
+    one.num_records = 1;
+    one.lightning = rec->lightning;
+    one.temperature = rec->temperature;
+    one.humidity = rec->humidity;
+    one.minTemp = rec->temperature;
+    one.maxTemp = rec->temperature;
+    geoMerge(table, &one);
+}
+
+/**************************************************
+*Converts days since 1970-01-01 to a civil date
+*(proleptic Gregorian, UTC)
+**************************************************/
+static void civilFromDays(long long days, int *year, int *month, int *day)
+{
+    days += 719468;
+    long long era = (days >= 0 ? days : days - 146096) / 146097;
+    long long doe = days - era * 146097;
+    long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long long mp = (5 * doy + 2) / 153;
+    *day = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *month = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *year = (int)(yoe + era * 400 + (*month <= 2));
+}
+
+/**************************************************
+*Converts a civil date to days since 1970-01-01
+**************************************************/
+static long long daysFromCivil(int year, int month, int day)
+{
+    year -= month <= 2;
+    long long era = (year >= 0 ? year : year - 399) / 400;
+    long long yoe = year - era * 400;
+    long long doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/**************************************************
+*Maps a millisecond timestamp to its bucket number
+*for the configured rollup unit
+**************************************************/
+static long long rollupBucket(unsigned long long timestamp)
+{
+    long long ms = (long long)timestamp;
+    long long days = ms >= 0 ? ms / 86400000 : (ms - 86399999) / 86400000;
+    int year, month, day;
+    switch (options.rollup)
+    {
+    case ROLLUP_HOUR:
+        return ms >= 0 ? ms / 3600000 : (ms - 3599999) / 3600000;
+    case ROLLUP_DAY:
+        return days;
+    default:
+        civilFromDays(days, &year, &month, &day);
+        return (long long)year * 12 + (month - 1);
+    }
+}
+
+/**************************************************
+*Returns 1 if some millisecond timestamp falls in
+*bucket number b, so b is safe to hand to rollupAt
+**************************************************/
+static int rollupValid(long long b)
+{
+    return b >= rollupBucket((unsigned long long)(LLONG_MIN + 86400000)) && b <= rollupBucket(LLONG_MAX);
+}
+
+/**************************************************
+*Returns the bucket numbers of the first bucket of
+*a calendar year and of the year after it
+**************************************************/
+static void rollupYear(int year, long long *start, long long *end)
+{
+    switch (options.rollup)
+    {
+    case ROLLUP_HOUR:
+        *start = daysFromCivil(year, 1, 1) * 24;
+        *end = daysFromCivil(year + 1, 1, 1) * 24;
+        break;
+    case ROLLUP_DAY:
+        *start = daysFromCivil(year, 1, 1);
+        *end = daysFromCivil(year + 1, 1, 1);
+        break;
+    default:
+        *start = (long long)year * 12;
+        *end = (long long)(year + 1) * 12;
+        break;
+    }
+}
+
+/**************************************************
+*Returns the bucket for bucket number b, extending
+*the series to cover it. A new series is sized for
+*the calendar year containing b; after that the run
+*at least doubles each time it has to grow, up to
+*ROLLUP_MAX_BUCKETS. Returns NULL if b cannot be
+*covered within that span.
+**************************************************/
+static struct time_bucket *rollupAt(struct climate_table *table, struct time_series *series, long long b)
+{
+    if (series->buckets != NULL && b >= series->first && b < series->first + series->length)
+    {
+        return &series->buckets[b - series->first];
+    }
+    if (series->buckets != NULL
+        && (b < series->first + series->length - ROLLUP_MAX_BUCKETS || b >= series->first + ROLLUP_MAX_BUCKETS))
+    {
+        return NULL;
+    }
+
+    long long first, last;
+    if (series->buckets == NULL)
+    {
+        int year, month, day;
+        long long days = options.rollup == ROLLUP_HOUR ? (b >= 0 ? b / 24 : (b - 23) / 24)
+                       : options.rollup == ROLLUP_DAY ? b : daysFromCivil((int)(b >= 0 ? b / 12 : (b - 11) / 12), 1, 1);
+        civilFromDays(days, &year, &month, &day);
+        rollupYear(year, &first, &last);
+        //a bucket so far out that its year does not fit an int
+        if (b < first || b >= last)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        first = series->first;
+        last = series->first + series->length;
+        if (b < first)
+        {
+            first = b < first - series->length ? b : first - series->length;
+            first = last - first > ROLLUP_MAX_BUCKETS ? last - ROLLUP_MAX_BUCKETS : first;
+        }
+        else
+        {
+            last = b >= last + series->length ? b + 1 : last + series->length;
+            last = last - first > ROLLUP_MAX_BUCKETS ? first + ROLLUP_MAX_BUCKETS : last;
+        }
+    }
+
+    struct time_bucket *buckets = arena_alloc(&table->arena, (size_t)(last - first) * sizeof(struct time_bucket));
+    if (series->buckets != NULL)
+    {
+        memcpy(&buckets[series->first - first], series->buckets, (size_t)series->length * sizeof(struct time_bucket));
+    }
+    series->buckets = buckets;
+    series->first = first;
+    series->length = last - first;
+    return &series->buckets[b - first];
+}
+
+/**************************************************
+*Adds one bucket's worth of observations to another
+**************************************************/
+static void rollupMerge(struct time_bucket *to, const struct time_bucket *from)
+{
+    if (from->num_records == 0)
+    {
+        return;
+    }
+    if (to->num_records == 0 || from->minTemp < to->minTemp)
+    {
+        to->minTemp = from->minTemp;
+    }
+    if (to->num_records == 0 || from->maxTemp > to->maxTemp)
+    {
+        to->maxTemp = from->maxTemp;
+    }
+    to->num_records += from->num_records;
+    to->lightning += from->lightning;
+    to->temperature += from->temperature;
+    to->humidity += from->humidity;
+}
+
+static void rollupAccumulate(struct climate_table *table, int order, const struct tdv_record *rec)
+{
+    struct time_bucket *bucket = rollupAt(table, &table->rollups[order], rollupBucket(rec->timestamp));
+    struct time_bucket one;
+    if (bucket == NULL)
+    {
+        table->rejected++;
+        return;
+    }
+    one.num_records = 1;
+    one.lightning = rec->lightning;
+    one.temperature = rec->temperature;
+    one.humidity = rec->humidity;
+    one.minTemp = rec->temperature;
+    one.maxTemp = rec->temperature;
+    rollupMerge(bucket, &one);
+}
+
+static int compareCentroids(const void *a, const void *b)
+{
+    double x = ((const struct centroid *)a)->mean;
+    double y = ((const struct centroid *)b)->mean;
+    return x < y ? -1 : x > y;
+}
+
+/* The t-digest k1 scale function and its inverse: a centroid may span at
+ * most one unit of k. */
+static double digestScale(double q)
+{
+    return DIGEST_COMPRESSION / (2 * M_PI) * asin(2 * q - 1);
+}
+
+static double digestScaleInverse(double k)
+{
+    if (k >= DIGEST_COMPRESSION / 4.0)
+    {
+        return 1;
+    }
+    return (sin(k * 2 * M_PI / DIGEST_COMPRESSION) + 1) / 2;
+}
+
+/**************************************************
+*Folds the buffered values of a digest into its
+*centroids
+**************************************************/
+static void digestCompress(struct digest *d)
+{
+    struct centroid merged[DIGEST_CAPACITY + DIGEST_BUFFER];
+    int n = 0, a = 0, b = 0, i;
+    if (d->num_buffered == 0)
+    {
+        return;
+    }
+    qsort(d->buffer, (size_t)d->num_buffered, sizeof(struct centroid), compareCentroids);
+    while (a < d->num_centroids || b < d->num_buffered)
+    {
+        if (b == d->num_buffered || (a < d->num_centroids && d->centroids[a].mean <= d->buffer[b].mean))
+        {
+            merged[n++] = d->centroids[a++];
+        }
+        else
+        {
+            merged[n++] = d->buffer[b++];
+        }
+    }
+
+    //greedily grow each centroid while it stays within one unit of k
+    double sofar = 0;
+    double limit = d->total * digestScaleInverse(digestScale(0) + 1);
+    struct centroid current = merged[0];
+    int out = 0;
+    for (i = 1; i < n; i++)
+    {
+        if (sofar + current.weight + merged[i].weight <= limit)
+        {
+            current.weight += merged[i].weight;
+            current.mean += (merged[i].mean - current.mean) * merged[i].weight / current.weight;
+        }
+        else
+        {
+            sofar += current.weight;
+            d->centroids[out++] = current;
+            limit = d->total * digestScaleInverse(digestScale(sofar / d->total) + 1);
+            current = merged[i];
+        }
+    }
+    d->centroids[out++] = current;
+    d->num_centroids = out;
+    d->num_buffered = 0;
+}
+
+static void digestInsert(struct digest *d, double mean, double weight)
+{
+    if (d->num_buffered == DIGEST_BUFFER)
+    {
+        digestCompress(d);
+    }
+    d->buffer[d->num_buffered].mean = mean;
+    d->buffer[d->num_buffered].weight = weight;
+    d->num_buffered++;
+    d->total += weight;
+}
+
+static void digestAdd(struct digest *d, double value)
+{
+    if (value != value)
+    {
+        return;     //NaN has no place in the order
+    }
+    if (d->total == 0 || value < d->min)
+    {
+        d->min = value;
+    }
+    if (d->total == 0 || value > d->max)
+    {
+        d->max = value;
+    }
+    digestInsert(d, value, 1);
+}
+
+/**************************************************
+*Adds every value summarized by one digest to another
+**************************************************/
+static void digestMerge(struct digest *to, const struct digest *from)
+{
+    int i;
+    if (from->total == 0)
+    {
+        return;
+    }
+    if (to->total == 0 || from->min < to->min)
+    {
+        to->min = from->min;
+    }
+    if (to->total == 0 || from->max > to->max)
+    {
+        to->max = from->max;
+    }
+    for (i = 0; i < from->num_centroids; i++)
+    {
+        digestInsert(to, from->centroids[i].mean, from->centroids[i].weight);
+    }
+    for (i = 0; i < from->num_buffered; i++)
+    {
+        digestInsert(to, from->buffer[i].mean, from->buffer[i].weight);
+    }
+}
+
+/**************************************************
+*Returns the estimated q-quantile (0..1) of the values
+*in a digest, interpolating between centroid centers
+**************************************************/
+static double digestQuantile(const struct digest *d, double q)
+{
+    struct digest sorted = *d;
+    digestCompress(&sorted);
+    const struct centroid *c = sorted.centroids;
+    int n = sorted.num_centroids, i;
+    if (n == 0)
+    {
+        return NAN;
+    }
+    if (n == 1)
+    {
+        return c[0].mean;
+    }
+
+    double index = q * sorted.total;
+    if (index < c[0].weight / 2)
+    {
+        return sorted.min + (c[0].mean - sorted.min) * index / (c[0].weight / 2);
+    }
+    double center = c[0].weight / 2;
+    for (i = 0; i + 1 < n; i++)
+    {
+        double step = (c[i].weight + c[i + 1].weight) / 2;
+        if (index < center + step)
+        {
+            return c[i].mean + (c[i + 1].mean - c[i].mean) * (index - center) / step;
+        }
+        center += step;
+    }
+    double tail = (index - center) / (c[n - 1].weight / 2);
+    return c[n - 1].mean + (sorted.max - c[n - 1].mean) * (tail < 1 ? tail : 1);
+}
+
+/**************************************************
+*Returns the order of a state, adding it to the
+*table if this is the first record for it
+**************************************************/
+static int stateOrder(struct climate_table *table, const char code[3])
+{
+    int stateNumOrder = compareOrder(table, code);
+    if (stateNumOrder == -1)// if the state is the first of its kind in the struct
+    {
+        STATS_COUNT(&table->stats, state_misses, 1);
+        stateNumOrder = addState(table, code);
+        table->states[stateNumOrder].minTemp = INFINITY;
+        table->states[stateNumOrder].maxTemp = -INFINITY;
+    }
+    return stateNumOrder;
+}
+
+/* The statement that parses one column of each kind. The geohash is only
+ * packed when something uses it. */
+#define TDV_PARSE(name, kind, label) TDV_PARSE_##kind(name)
+#define TDV_PARSE_CODE(name)
+#define TDV_PARSE_TIMESTAMP(name) cursor = fields[TDV_COL_##name]; rec->name = (unsigned long long)parseInteger(&cursor);
+#define TDV_PARSE_GEOHASH(name) rec->name = wantGeohash ? packGeohash(fields[TDV_COL_##name]) : 0;
+#define TDV_PARSE_DECIMAL(name) cursor = fields[TDV_COL_##name]; rec->name = parseDecimal(&cursor);
+#define TDV_PARSE_INTEGER(name) cursor = fields[TDV_COL_##name]; rec->name = (int)parseInteger(&cursor);
+#define TDV_PARSE_EXTRA(name) cursor = fields[TDV_COL_##name]; rec->extra[TDV_EXTRA_##name] = parseDecimal(&cursor);
+#define TDV_PARSE_SKIP(name)
+
+/**************************************************
+*Parses one record in place. fields[] holds the
+*start of each column, and end is the record's
+*newline; the numeric parsers stop at the delimiter
+*after each column. The body is one statement per
+*column of the TDV_SCHEMA layout.
+**************************************************/
+static void parseRecord(const char *const fields[TDV_FIELDS], const char *end, struct tdv_record *rec, int wantGeohash)
+{
+    const char *codeEnd = fields[1] > fields[0] ? fields[1] - 1 : end;
+    size_t codeLen = (size_t)(codeEnd - fields[0]);
+    memset(rec->code, 0, sizeof(rec->code));
+    memcpy(rec->code, fields[0], codeLen < 2 ? codeLen : 2);
+
+    const char *cursor;
+    TDV_COLUMNS(TDV_PARSE)
+}
+
+/* Independent partial sums per reduction so the loops below vectorize
+ * without reassociating a single running sum. */
+#define REDUCE_LANES 4
+
+/**************************************************
+*Adds x to a compensated sum (Neumaier's variant of
+*Kahan summation): *error collects the low-order
+*bits that *sum cannot hold. Written as a select, so
+*it vectorizes; it does rely on the compiler keeping
+*IEEE semantics (no -ffast-math).
+**************************************************/
+static inline void addCompensated(double *sum, double *error, double x)
+{
+    double t = *sum + x;
+    *error += fabs(*sum) >= fabs(x) ? (*sum - t) + x : (x - t) + *sum;
+    *sum = t;
+}
+
+/* Runs shorter than this are cheaper to add one record at a time. */
+#define REDUCE_MIN_RUN 16
+
+/**************************************************
+*Adds record i of the columns to its state's totals
+**************************************************/
+static void accumulateOne(struct climate_info *info, const struct record_columns *cols, int i)
+{
+    info->num_records += 1;
+    addCompensated(&info->avgHumidity, &info->humidityError, cols->humidity[i]);
+    info->snow += cols->snow[i];
+    addCompensated(&info->cloud, &info->cloudError, cols->cloud[i]);
+    info->lightning += cols->lightning[i];
+    addCompensated(&info->pressure, &info->pressureError, cols->pressure[i]);
+    addCompensated(&info->temperature, &info->temperatureError, cols->temperature[i]);
+    int e;
+    for (e = 0; e < TDV_NUM_EXTRAS; e++)
+    {
+        addCompensated(&info->extra[e], &info->extraError[e], cols->extra[e][i]);
+    }
+
+    //Checking if the temperature is the minimum or maximum temp for that State
+    if(cols->temperature[i] < info->minTemp)
+    {
+        info->minTemp = cols->temperature[i];
+        info->minTempTimestamp = cols->timestamp[i];
+    }
+    if(cols->temperature[i] > info->maxTemp)
+    {
+        info->maxTemp = cols->temperature[i];
+        info->maxTempTimestamp = cols->timestamp[i];
+    }
+}
+
+/**************************************************
+*Adds records start..end-1, which all belong to the
+*same state, to that state's totals. Compensated sums
+*and the min/max search run over REDUCE_LANES lanes; the
+*timestamp of a new extreme is looked up afterwards
+*(the first record holding it, as a serial scan
+*would pick).
+**************************************************/
+static void reduceRun(struct climate_info *info, const struct record_columns *cols, int start, int end)
+{
+    double humidity[REDUCE_LANES] = { 0 }, cloud[REDUCE_LANES] = { 0 };
+    double pressure[REDUCE_LANES] = { 0 }, temperature[REDUCE_LANES] = { 0 };
+    double humidityError[REDUCE_LANES] = { 0 }, cloudError[REDUCE_LANES] = { 0 };
+    double pressureError[REDUCE_LANES] = { 0 }, temperatureError[REDUCE_LANES] = { 0 };
+    double lo[REDUCE_LANES], hi[REDUCE_LANES];
+    long long snow = 0, lightning = 0;
+    int i, k, e;
+
+    //seeded with infinities so a NaN reading fails every comparison, as in accumulateOne
+    for (k = 0; k < REDUCE_LANES; k++)
+    {
+        lo[k] = INFINITY;
+        hi[k] = -INFINITY;
+    }
+    for (i = start; i + REDUCE_LANES <= end; i += REDUCE_LANES)
+    {
+        for (k = 0; k < REDUCE_LANES; k++)
+        {
+            double t = cols->temperature[i + k];
+            addCompensated(&humidity[k], &humidityError[k], cols->humidity[i + k]);
+            addCompensated(&cloud[k], &cloudError[k], cols->cloud[i + k]);
+            addCompensated(&pressure[k], &pressureError[k], cols->pressure[i + k]);
+            addCompensated(&temperature[k], &temperatureError[k], t);
+            lo[k] = t < lo[k] ? t : lo[k];
+            hi[k] = t > hi[k] ? t : hi[k];
+        }
+    }
+    for (; i < end; i++)
+    {
+        double t = cols->temperature[i];
+        addCompensated(&humidity[0], &humidityError[0], cols->humidity[i]);
+        addCompensated(&cloud[0], &cloudError[0], cols->cloud[i]);
+        addCompensated(&pressure[0], &pressureError[0], cols->pressure[i]);
+        addCompensated(&temperature[0], &temperatureError[0], t);
+        lo[0] = t < lo[0] ? t : lo[0];
+        hi[0] = t > hi[0] ? t : hi[0];
+    }
+    for (i = start; i < end; i++)
+    {
+        snow += cols->snow[i];
+        lightning += cols->lightning[i];
+    }
+    for (e = 0; e < TDV_NUM_EXTRAS; e++)
+    {
+        double sum[REDUCE_LANES] = { 0 }, error[REDUCE_LANES] = { 0 };
+        for (i = start; i + REDUCE_LANES <= end; i += REDUCE_LANES)
+        {
+            for (k = 0; k < REDUCE_LANES; k++)
+            {
+                addCompensated(&sum[k], &error[k], cols->extra[e][i + k]);
+            }
+        }
+        for (; i < end; i++)
+        {
+            addCompensated(&sum[0], &error[0], cols->extra[e][i]);
+        }
+        for (k = 0; k < REDUCE_LANES; k++)
+        {
+            addCompensated(&info->extra[e], &info->extraError[e], sum[k]);
+            info->extraError[e] += error[k];
+        }
+    }
+
+    for (k = 1; k < REDUCE_LANES; k++)
+    {
+        addCompensated(&humidity[0], &humidityError[0], humidity[k]);
+        addCompensated(&cloud[0], &cloudError[0], cloud[k]);
+        addCompensated(&pressure[0], &pressureError[0], pressure[k]);
+        addCompensated(&temperature[0], &temperatureError[0], temperature[k]);
+        humidityError[0] += humidityError[k];
+        cloudError[0] += cloudError[k];
+        pressureError[0] += pressureError[k];
+        temperatureError[0] += temperatureError[k];
+        lo[0] = lo[k] < lo[0] ? lo[k] : lo[0];
+        hi[0] = hi[k] > hi[0] ? hi[k] : hi[0];
+    }
+
+    info->num_records += (unsigned int)(end - start);
+    addCompensated(&info->avgHumidity, &info->humidityError, humidity[0]);
+    addCompensated(&info->cloud, &info->cloudError, cloud[0]);
+    addCompensated(&info->pressure, &info->pressureError, pressure[0]);
+    addCompensated(&info->temperature, &info->temperatureError, temperature[0]);
+    info->humidityError += humidityError[0];
+    info->cloudError += cloudError[0];
+    info->pressureError += pressureError[0];
+    info->temperatureError += temperatureError[0];
+    info->snow += (int)snow;
+    info->lightning += (int)lightning;
+
+    if (lo[0] < info->minTemp)
+    {
+        for (i = start; cols->temperature[i] != lo[0]; i++)
+        {
+        }
+        info->minTemp = lo[0];
+        info->minTempTimestamp = cols->timestamp[i];
+    }
+    if (hi[0] > info->maxTemp)
+    {
+        for (i = start; cols->temperature[i] != hi[0]; i++)
+        {
+        }
+        info->maxTemp = hi[0];
+        info->maxTempTimestamp = cols->timestamp[i];
+    }
+}
+
+/**************************************************
+*Maps a double to a key that orders like the value
+*(positive values have the top bit set). Equal keys
+*mean equal bits, so maxima compare exactly.
+**************************************************/
+static uint64_t orderedKey(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits >> 63 ? ~bits : bits | (1ULL << 63);
+}
+
+static double orderedValue(uint64_t key)
+{
+    uint64_t bits = key >> 63 ? key & ~(1ULL << 63) : ~key;
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static void atomicMax(uint64_t *target, uint64_t value)
+{
+    uint64_t seen = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while (value > seen && !__atomic_compare_exchange_n(target, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+static void atomicAddDouble(uint64_t *target, double x)
+{
+    uint64_t seen = __atomic_load_n(target, __ATOMIC_RELAXED);
+    uint64_t sum;
+    do
+    {
+        double value;
+        memcpy(&value, &seen, sizeof(value));
+        value += x;
+        memcpy(&sum, &value, sizeof(sum));
+    } while (!__atomic_compare_exchange_n(target, &seen, sum, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**************************************************
+*Returns the group for key, adding one if the key is
+*new, or NULL if the table has no groups left. A new
+*group is filled in before a CAS publishes it in the
+*index; a thread that loses the race for the same
+*key gives its group up.
+**************************************************/
+static struct shared_group *sharedGroup(struct shared_groups *groups, uint64_t key)
+{
+    unsigned int h = geoHashKey(key) & (SHARED_INDEX_SLOTS - 1);
+    uint32_t mine = 0;
+    for (;;)
+    {
+        uint32_t seen = __atomic_load_n(&groups->index[h], __ATOMIC_ACQUIRE);
+        if (seen == 0)
+        {
+            if (mine == 0)
+            {
+                unsigned int n = __atomic_fetch_add(&groups->used, 1, __ATOMIC_RELAXED);
+                if (n >= SHARED_MAX_GROUPS)
+                {
+                    return NULL;
+                }
+                groups->groups[n].key = key;
+                mine = n + 1;
+            }
+            if (__atomic_compare_exchange_n(&groups->index[h], &seen, mine, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                return &groups->groups[mine - 1];
+            }
+        }
+        if (groups->groups[seen - 1].key == key)
+        {
+            if (mine != 0)
+            {
+                groups->groups[mine - 1].key = 0;
+            }
+            return &groups->groups[seen - 1];
+        }
+        h = (h + 1) & (SHARED_INDEX_SLOTS - 1);
+    }
+}
+
+/**************************************************
+*Adds one record to the group for key. Returns 0 if
+*the shared table is full and the caller has to keep
+*the record in its own table.
+**************************************************/
+static int sharedAdd(struct shared_groups *groups, uint64_t key, const struct tdv_record *rec)
+{
+    struct shared_group *group = sharedGroup(groups, key);
+    if (group == NULL)
+    {
+        return 0;
+    }
+    __atomic_fetch_add(&group->num_records, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&group->lightning, rec->lightning, __ATOMIC_RELAXED);
+    atomicAddDouble(&group->temperature, rec->temperature);
+    atomicAddDouble(&group->humidity, rec->humidity);
+    atomicMax(&group->minKey, ~orderedKey(rec->temperature));
+    atomicMax(&group->maxKey, orderedKey(rec->temperature));
+    return 1;
+}
+
+/* Buckets are keyed on the state's slot key (+1, so no key is 0) and the
+ * bucket number, which fits 48 bits for any timestamp in the data. */
+static uint64_t rollupKey(int stateSlot, long long bucket)
+{
+    return ((uint64_t)(stateSlot + 1) << 48) | ((uint64_t)bucket & ((1ULL << 48) - 1));
+}
+
+/* Returns 1 if a ranks above b: a larger key, then the earlier reading,
+ * then the lower geohash. */
+static int eventAbove(const struct extreme_event *a, const struct extreme_event *b)
+{
+    if (a->key != b->key)
+    {
+        return a->key > b->key;
+    }
+    if (a->timestamp != b->timestamp)
+    {
+        return a->timestamp < b->timestamp;
+    }
+    return a->geohash < b->geohash;
+}
+
+/**************************************************
+*Adds an event to a top-K heap if it ranks among the
+*K best. Callers check key >= floor first, so a
+*reading that cannot make the list costs only that.
+**************************************************/
+static void topOffer(struct top_events *top, const struct extreme_event *event)
+{
+    struct extreme_event *heap = top->heap;
+    int i;
+    if (top->count < options.top)
+    {
+        //sift the new event up from the end
+        for (i = top->count++; i > 0 && eventAbove(&heap[(i - 1) / 2], event); i = (i - 1) / 2)
+        {
+            heap[i] = heap[(i - 1) / 2];
+        }
+        heap[i] = *event;
+    }
+    else if (eventAbove(event, &heap[0]))
+    {
+        //replace the weakest and sift it down
+        for (i = 0; 2 * i + 1 < top->count;)
+        {
+            int child = 2 * i + 1;
+            if (child + 1 < top->count && eventAbove(&heap[child], &heap[child + 1]))
+            {
+                child++;
+            }
+            if (!eventAbove(event, &heap[child]))
+            {
+                break;
+            }
+            heap[i] = heap[child];
+            i = child;
+        }
+        heap[i] = *event;
+    }
+    if (top->count == options.top)
+    {
+        top->floor = heap[0].key;
+    }
+}
+
+static void topMerge(struct top_events *to, const struct top_events *from)
+{
+    int i;
+    for (i = 0; i < from->count; i++)
+    {
+        if (from->heap[i].key >= to->floor)
+        {
+            topOffer(to, &from->heap[i]);
+        }
+    }
+}
+
+/**************************************************
+*Adds a set of records to table: state totals by
+*runs of the same state, then the geohash and time
+*rollups (which are keyed per record) if enabled,
+*then the --top extreme events
+**************************************************/
+static void accumulateColumns(struct climate_table *table, const struct record_columns *cols)
+{
+    int start = 0;
+    while (start < cols->count)
+    {
+        int end = start + 1;
+        while (end < cols->count && cols->order[end] == cols->order[start])
+        {
+            end++;
+        }
+        struct climate_info *info = &table->states[cols->order[start]];
+        struct chunk_states *seen = table->first_seen;
+        if (seen != NULL && !seen->noted[cols->order[start]])
+        {
+            seen->noted[cols->order[start]] = 1;
+            memcpy(seen->codes[seen->count++], info->code, sizeof(info->code));
+        }
+        if (end - start < REDUCE_MIN_RUN)
+        {
+            int i;
+            for (i = start; i < end; i++)
+            {
+                accumulateOne(info, cols, i);
+            }
+        }
+        else
+        {
+            reduceRun(info, cols, start, end);
+        }
+        start = end;
+    }
+
+    if (options.geohash_precision > 0 || options.rollup != ROLLUP_NONE)
+    {
+        int i;
+        for (i = 0; i < cols->count; i++)
+        {
+            struct tdv_record rec;
+            rec.timestamp = cols->timestamp[i];
+            rec.geohash = cols->geohash[i];
+            rec.humidity = cols->humidity[i];
+            rec.lightning = cols->lightning[i];
+            rec.temperature = cols->temperature[i];
+            int geoShared = 0, rollupShared = 0;
+            if (table->shared != NULL)
+            {
+                uint64_t key = geoCellKey(cols->slot[i], rec.geohash);
+                geoShared = options.geohash_precision > 0 && key != 0 && sharedAdd(&table->shared->geo, key, &rec);
+                rollupShared = options.rollup != ROLLUP_NONE && cols->slot[i] >= 0
+                    && sharedAdd(&table->shared->rollup, rollupKey(cols->slot[i], rollupBucket(rec.timestamp)), &rec);
+            }
+            if (options.geohash_precision > 0 && !geoShared)
+            {
+                geoAccumulate(table, cols->slot[i], &rec);
+            }
+            if (options.rollup != ROLLUP_NONE && !rollupShared)
+            {
+                rollupAccumulate(table, cols->order[i], &rec);
+            }
+        }
+    }
+
+    if (options.percentiles)
+    {
+        int i;
+        for (i = 0; i < cols->count; i++)
+        {
+            struct state_digests *digests = &table->digests[cols->order[i]];
+            digestAdd(&digests->temperature, cols->temperature[i]);
+            digestAdd(&digests->humidity, cols->humidity[i]);
+        }
+    }
+
+    if (options.top > 0)
+    {
+        int i;
+        for (i = 0; i < cols->count; i++)
+        {
+            struct state_extremes *extremes = &table->extremes[cols->order[i]];
+            double t = cols->temperature[i];
+            if (t >= extremes->hottest.floor)
+            {
+                struct extreme_event event = { t, cols->timestamp[i], cols->geohash[i] };
+                topOffer(&extremes->hottest, &event);
+            }
+            if (-t >= extremes->coldest.floor)
+            {
+                struct extreme_event event = { -t, cols->timestamp[i], cols->geohash[i] };
+                topOffer(&extremes->coldest, &event);
+            }
+        }
+    }
+}
+
+/**************************************************
+*Accumulates and empties the table's pending batch
+**************************************************/
+static void flushBatch(struct climate_table *table)
+{
+    struct record_batch *batch = table->batch;
+    if (batch->count == 0)
+    {
+        return;
+    }
+    STATS_ENTER(&table->stats, PHASE_ACCUMULATE, prev);
+    struct record_columns cols = {
+        batch->count, batch->order, batch->slot, batch->timestamp, batch->geohash,
+        batch->humidity, batch->cloud, batch->pressure, batch->temperature, batch->snow, batch->lightning, { NULL }
+    };
+    int e;
+    for (e = 0; e < TDV_NUM_EXTRAS; e++)
+    {
+        cols.extra[e] = batch->extra[e];
+    }
+    accumulateColumns(table, &cols);
+    batch->count = 0;
+    STATS_LEAVE(&table->stats, prev);
+}
+
+/**************************************************
+*Appends a parsed record to the table's batch
+**************************************************/
+static void batchAppend(struct climate_table *table, const struct tdv_record *rec)
+{
+    struct record_batch *batch = table->batch;
+    int i = batch->count;
+    STATS_TICK(start);
+    batch->order[i] = (short)stateOrder(table, rec->code);
+    batch->slot[i] = (short)stateKey(rec->code);
+    STATS_TOCK(&table->stats, lookup_ticks, start);
+    batch->timestamp[i] = rec->timestamp;
+    batch->geohash[i] = rec->geohash;
+    batch->humidity[i] = rec->humidity;
+    batch->cloud[i] = rec->cloud;
+    batch->pressure[i] = rec->pressure;
+    batch->temperature[i] = rec->temperature;
+    batch->snow[i] = rec->snow;
+    batch->lightning[i] = rec->lightning;
+    int e;
+    for (e = 0; e < TDV_NUM_EXTRAS; e++)
+    {
+        batch->extra[e][i] = rec->extra[e];
+    }
+    if (++batch->count == BATCH_RECORDS)
+    {
+        flushBatch(table);
+    }
+}
+
+struct cache_writer;
+static void cacheAppend(struct cache_writer *writer, const struct tdv_record *rec);
+static void zoneNote(struct zone_entry *zone, const char *const fields[TDV_FIELDS]);
+
+/* Where scanned records go: into table, or into a cache file being built.
+ * With zone set, every record is also noted in that zone map entry. */
+struct record_sink {
+    struct run_stats *stats;
+    unsigned long long *rejected;
+    struct climate_table *table;
+    struct cache_writer *cache;
+    struct zone_entry *zone;
+};
+
+/**************************************************
+*Sets the --states filter from a comma-separated
+*list of codes. Returns 0 on success, -1 if an entry
+*is not two uppercase letters.
+**************************************************/
+int parse_state_filter(const char *list)
+{
+    unsigned char wanted[STATE_CODE_SLOTS];
+    memset(wanted, 0, sizeof(wanted));
+    do
+    {
+        int key = stateKey(list);
+        if (key < 0 || (list[2] != ',' && list[2] != '\0'))
+        {
+            return -1;
+        }
+        wanted[key] = 1;
+        list += 2;
+    } while (*list++ == ',');
+
+    memcpy(options.state_wanted, wanted, sizeof(wanted));
+    options.filter_states = 1;
+    options.filtering = 1;
+    return 0;
+}
+
+/**************************************************
+*Parses a --from/--to time: milliseconds since the
+*epoch as in the TDV timestamp column, or a UTC date
+*YYYY-MM, YYYY-MM-DD or YYYY-MM-DDTHH:MM[:SS].
+*Returns 0 on success, -1 if text is neither.
+**************************************************/
+int parse_timestamp(const char *text, unsigned long long *timestamp)
+{
+    if (*text != '\0' && text[strspn(text, "0123456789")] == '\0')
+    {
+        *timestamp = strtoull(text, NULL, 10);
+        return 0;
+    }
+
+    int year, month, day = 1, hour = 0, minute = 0, second = 0, used = 0;
+    if (sscanf(text, "%4d-%2d%n", &year, &month, &used) != 2)
+    {
+        return -1;
+    }
+    const char *p = text + used;
+    if (*p == '-' && sscanf(p, "-%2d%n", &day, &used) == 1)
+    {
+        p += used;
+        if (*p == 'T' && sscanf(p, "T%2d:%2d%n", &hour, &minute, &used) == 2)
+        {
+            p += used;
+            if (*p == ':' && sscanf(p, ":%2d%n", &second, &used) == 1)
+            {
+                p += used;
+            }
+        }
+    }
+    if (*p != '\0' || year < 1970 || month < 1 || month > 12 || day < 1 || day > 31
+        || hour > 23 || minute > 59 || second > 59)
+    {
+        return -1;
+    }
+    long long seconds = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    *timestamp = (unsigned long long)seconds * 1000;
+    return 0;
+}
+
+/**************************************************
+*Parses a --min-temp/--max-temp threshold in degrees
+*Fahrenheit into Kelvin, the unit of the TDV files.
+*Returns 0 on success, -1 if text is not a number.
+**************************************************/
+int parse_temperature(const char *text, double *kelvin)
+{
+    char *end;
+    double degrees = strtod(text, &end);
+    if (end == text || *end != '\0' || !isfinite(degrees))
+    {
+        return -1;
+    }
+    *kelvin = (degrees - 32) * 5 / 9 + 273.15;
+    return 0;
+}
+
+/**************************************************
+*Sets the --geohash-prefix filter. Returns 0 on
+*success, -1 if prefix is empty, too long or not
+*geohash characters.
+**************************************************/
+int parse_geohash_prefix(const char *prefix)
+{
+    size_t len = strlen(prefix);
+    uint64_t packed = packGeohash(prefix);
+    if (len == 0 || len > GEOHASH_PREFIX_MAX || (size_t)(packed >> 60) != len)
+    {
+        return -1;
+    }
+    memcpy(options.geohash_prefix, prefix, len + 1);
+    options.prefix_len = (int)len;
+    options.prefix_bits = packed & ((1ULL << 60) - 1);
+    options.filtering = 1;
+    return 0;
+}
+
+/**************************************************
+*Returns 1 if a scanned line passes the filters.
+*The state code and geohash are compared as text and
+*only the timestamp is parsed, so dropped records
+*never reach the numeric parsers.
+**************************************************/
+static int recordWanted(const char *const fields[TDV_FIELDS])
+{
+    if (options.filter_states)
+    {
+        int key = stateKey(fields[TDV_COL_code]);
+        if (key < 0 || !options.state_wanted[key])
+        {
+            return 0;
+        }
+    }
+    //a shorter geohash differs at its tab, which the prefix never contains
+    if (options.prefix_len > 0 && memcmp(fields[TDV_COL_geohash], options.geohash_prefix, (size_t)options.prefix_len) != 0)
+    {
+        return 0;
+    }
+    const char *cursor = fields[TDV_COL_timestamp];
+    unsigned long long timestamp = (unsigned long long)parseInteger(&cursor);
+    if (timestamp < options.from || timestamp >= options.to)
+    {
+        return 0;
+    }
+    if (options.filter_temperature)
+    {
+        cursor = fields[TDV_COL_temperature];
+        double temperature = parseDecimal(&cursor);
+        return temperature >= options.min_temperature && temperature <= options.max_temperature;
+    }
+    return 1;
+}
+
+static void emitRecord(const char *const fields[TDV_FIELDS], const char *end, struct record_sink *sink)
+{
+    struct tdv_record rec;
+    //zone maps, like caches, cover every record
+    if (sink->zone != NULL)
+    {
+        zoneNote(sink->zone, fields);
+    }
+    //caches hold every record; filters apply when they are read
+    if (options.filtering && sink->cache == NULL && !recordWanted(fields))
+    {
+        STATS_COUNT(sink->stats, filtered, 1);
+        return;
+    }
+    STATS_TICK(start);
+    parseRecord(fields, end, &rec, sink->cache != NULL || options.geohash_precision > 0 || options.top > 0);
+    STATS_TOCK(sink->stats, parse_ticks, start);
+    STATS_COUNT(sink->stats, records, 1);
+    if (sink->cache != NULL)
+    {
+        cacheAppend(sink->cache, &rec);
+        return;
+    }
+    batchAppend(sink->table, &rec);
+}
+
+/* Delimiters are located a 64-byte block at a time: each scanner sets bit i
+ * of *tabs or *newlines when block[i] is a tab or a newline. */
+#define SCAN_BLOCK 64
+
+typedef void (*delimiter_scanner)(const char *block, uint64_t *tabs, uint64_t *newlines);
+
+static void scanScalar(const char *block, uint64_t *tabs, uint64_t *newlines)
+{
+    uint64_t t = 0, n = 0;
+    int i;
+    for (i = 0; i < SCAN_BLOCK; i++)
+    {
+        t |= (uint64_t)(block[i] == '\t') << i;
+        n |= (uint64_t)(block[i] == '\n') << i;
+    }
+    *tabs = t;
+    *newlines = n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void scanSSE2(const char *block, uint64_t *tabs, uint64_t *newlines)
+{
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t t = 0, n = 0;
+    int i;
+    for (i = 0; i < SCAN_BLOCK; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(block + i));
+        t |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, tab)) << i;
+        n |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, nl)) << i;
+    }
+    *tabs = t;
+    *newlines = n;
+}
+
+__attribute__((target("avx2")))
+static void scanAVX2(const char *block, uint64_t *tabs, uint64_t *newlines)
+{
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i nl = _mm256_set1_epi8('\n');
+    __m256i lo = _mm256_loadu_si256((const __m256i *)block);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(block + 32));
+    *tabs = (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, tab))
+          | (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, tab)) << 32;
+    *newlines = (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl))
+              | (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl)) << 32;
+}
+#elif defined(__aarch64__)
+/* Folds four 16-byte compare results into one bit per byte. */
+static uint64_t neonMask(uint8x16_t a, uint8x16_t b, uint8x16_t c, uint8x16_t d)
+{
+    const uint8x16_t bits = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t ab = vpaddq_u8(vandq_u8(a, bits), vandq_u8(b, bits));
+    uint8x16_t cd = vpaddq_u8(vandq_u8(c, bits), vandq_u8(d, bits));
+    uint8x16_t sum = vpaddq_u8(ab, cd);
+    sum = vpaddq_u8(sum, sum);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
+}
+
+static void scanNEON(const char *block, uint64_t *tabs, uint64_t *newlines)
+{
+    const uint8x16_t tab = vdupq_n_u8('\t');
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    uint8x16_t b0 = vld1q_u8((const uint8_t *)block);
+    uint8x16_t b1 = vld1q_u8((const uint8_t *)block + 16);
+    uint8x16_t b2 = vld1q_u8((const uint8_t *)block + 32);
+    uint8x16_t b3 = vld1q_u8((const uint8_t *)block + 48);
+    *tabs = neonMask(vceqq_u8(b0, tab), vceqq_u8(b1, tab), vceqq_u8(b2, tab), vceqq_u8(b3, tab));
+    *newlines = neonMask(vceqq_u8(b0, nl), vceqq_u8(b1, nl), vceqq_u8(b2, nl), vceqq_u8(b3, nl));
+}
+#endif
+
+static delimiter_scanner scanBlock = scanScalar;
+static pthread_once_t scannerOnce = PTHREAD_ONCE_INIT;
+
+/**************************************************
+*Picks the widest delimiter scanner the CPU supports.
+*CLIMATE_SCANNER=scalar|sse2|avx2|neon overrides the
+*choice (unsupported names fall back to scalar).
+**************************************************/
+static void selectScanner(void)
+{
+    const char *forced = getenv("CLIMATE_SCANNER");
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (forced == NULL ? __builtin_cpu_supports("avx2") : strcmp(forced, "avx2") == 0)
+    {
+        scanBlock = scanAVX2;
+    }
+    else if (forced == NULL ? __builtin_cpu_supports("sse2") : strcmp(forced, "sse2") == 0)
+    {
+        scanBlock = scanSSE2;
+    }
+#elif defined(__aarch64__)
+    if (forced == NULL || strcmp(forced, "neon") == 0)
+    {
+        scanBlock = scanNEON;
+    }
+#else
+    (void)forced;
+#endif
+}
+
+/**************************************************
+*Counts a malformed line and copies it to the
+*--rejects file. Kept out of line so the scanner's
+*fast path only carries the single field-count test.
+**************************************************/
+__attribute__((noinline, cold))
+static void rejectLine(const char *start, const char *end, struct run_stats *stats, unsigned long long *rejected)
+{
+    *rejected += 1;
+    STATS_COUNT(stats, malformed, 1);
+    if (options.rejects != NULL)
+    {
+        //one locked write per line keeps lines from different workers whole
+        flockfile(options.rejects);
+        fwrite_unlocked(start, 1, (size_t)(end - start), options.rejects);
+        putc_unlocked('\n', options.rejects);
+        funlockfile(options.rejects);
+    }
+}
+
+/* Field starts collected so far for the record being scanned. */
+struct field_scan {
+    const char *fields[TDV_FIELDS];
+    int count;
+};
+
+/**************************************************
+*Consumes the delimiters in one block. Tabs start a
+*new field; a newline completes the current record.
+*Blank lines are ignored. A line is analyzed only if
+*it has exactly TDV_FIELDS fields and a two-letter
+*state code, so the parsers never see a missing
+*field; anything else is rejected.
+**************************************************/
+static void consumeBlock(const char *block, uint64_t tabs, uint64_t newlines,
+                         struct field_scan *scan, struct record_sink *sink)
+{
+    uint64_t delimiters = tabs | newlines;
+    while (delimiters != 0)
+    {
+        int bit = __builtin_ctzll(delimiters);
+        const char *pos = block + bit;
+        delimiters &= delimiters - 1;
+        if ((newlines >> bit) & 1)
+        {
+            if (scan->count == TDV_FIELDS && scan->fields[1] - scan->fields[0] == 3)
+            {
+                emitRecord(scan->fields, pos, sink);
+            }
+            else if (scan->count > 1 || pos > scan->fields[0])
+            {
+                rejectLine(scan->fields[0], pos, sink->stats, sink->rejected);
+            }
+            STATS_COUNT(sink->stats, lines, scan->count > 1 || pos > scan->fields[0]);
+            scan->fields[0] = pos + 1;
+            scan->count = 1;
+        }
+        else
+        {
+            if (scan->count < TDV_FIELDS)
+            {
+                scan->fields[scan->count] = pos + 1;
+            }
+            scan->count++;      //extra fields are counted, not kept
+        }
+    }
+}
+
+static void scanBuffer(const char *data, size_t len, struct record_sink *sink);
+
+/**************************************************
+*Parses text into table's batch, leaving the last
+*records pending
+**************************************************/
+static void scanText(const char *data, size_t len, struct climate_table *table)
+{
+    struct record_sink sink = { &table->stats, &table->rejected, table, NULL, table->zone };
+    STATS_ENTER(&table->stats, PHASE_SCAN, prev);
+    scanBuffer(data, len, &sink);
+    STATS_LEAVE(&table->stats, prev);
+}
+
+/* Input bytes for analyzeStream(): plain text, or gzip/zstd compressed
+ * data, read from a FILE or from memory (a mapped file). The compression
+ * is recognized by the stream's magic number, not the file name. */
+enum input_kind { INPUT_PLAIN, INPUT_GZIP, INPUT_ZSTD };
+
+#define GZIP_MAGIC "\x1f\x8b"
+#define ZSTD_MAGIC "\x28\xb5\x2f\xfd"
+#define COMPRESSED_INPUT_SIZE (1 << 18)     //compressed bytes read from a FILE at a time
+
+struct input_source {
+    enum input_kind kind;
+    FILE *file;                     //NULL when reading from data
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+    unsigned char peek[4];          //bytes read from file to detect the kind
+    size_t peek_len;
+    size_t peek_pos;
+    unsigned char *in;              //compressed bytes read from file
+    int finished;
+    int failed;
+#if HAVE_ZLIB
+    z_stream gz;
+#endif
+#if HAVE_ZSTD
+    ZSTD_DStream *zstd;
+    ZSTD_inBuffer zin;
+    size_t zstd_hint;               //0 when the last frame decoded is complete
+#endif
+};
+
+static enum input_kind inputKind(const unsigned char *data, size_t len)
+{
+    if (len >= 2 && memcmp(data, GZIP_MAGIC, 2) == 0)
+    {
+        return INPUT_GZIP;
+    }
+    if (len >= 4 && memcmp(data, ZSTD_MAGIC, 4) == 0)
+    {
+        return INPUT_ZSTD;
+    }
+    return INPUT_PLAIN;
+}
+
+/* Reads up to n raw (possibly compressed) bytes. */
+static size_t rawRead(struct input_source *src, void *dst, size_t n)
+{
+    size_t got = 0;
+    if (src->peek_pos < src->peek_len)
+    {
+        got = src->peek_len - src->peek_pos < n ? src->peek_len - src->peek_pos : n;
+        memcpy(dst, src->peek + src->peek_pos, got);
+        src->peek_pos += got;
+    }
+    if (got < n && src->file != NULL)
+    {
+        got += fread((char *)dst + got, 1, n - got, src->file);
+    }
+    else if (got < n)
+    {
+        size_t left = src->size - src->pos;
+        size_t take = left < n - got ? left : n - got;
+        memcpy((char *)dst + got, src->data + src->pos, take);
+        src->pos += take;
+        got += take;
+    }
+    return got;
+}
+
+/**************************************************
+*Prepares src to decode its kind of input. Returns
+*0, or -1 (after saying why) if this build cannot
+*read it.
+**************************************************/
+static int openSource(struct input_source *src)
+{
+    switch (src->kind)
+    {
+    case INPUT_GZIP:
+#if HAVE_ZLIB
+        memset(&src->gz, 0, sizeof(src->gz));
+        if (inflateInit2(&src->gz, 15 + 32) != Z_OK)        //15 + 32: gzip or zlib header
+        {
+            return -1;
+        }
+        src->in = src->file != NULL ? malloc(COMPRESSED_INPUT_SIZE) : NULL;
+        return 0;
+#else
+        fprintf(stderr, "gzip input needs a build with HAVE_ZLIB=1\n");
+        return -1;
+#endif
+    case INPUT_ZSTD:
+#if HAVE_ZSTD
+        src->zstd = ZSTD_createDStream();
+        if (src->zstd == NULL || ZSTD_isError(ZSTD_initDStream(src->zstd)))
+        {
+            ZSTD_freeDStream(src->zstd);
+            return -1;
+        }
+        src->in = src->file != NULL ? malloc(COMPRESSED_INPUT_SIZE) : NULL;
+        src->zstd_hint = 1;
+        src->zin.src = src->in;
+        src->zin.size = 0;
+        src->zin.pos = 0;
+        if (src->file == NULL)
+        {
+            src->zin.src = src->data + src->pos;
+            src->zin.size = src->size - src->pos;
+            src->pos = src->size;
+        }
+        return 0;
+#else
+        fprintf(stderr, "zstd input needs a build with HAVE_ZSTD=1\n");
+        return -1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+static void closeSource(struct input_source *src)
+{
+#if HAVE_ZLIB
+    if (src->kind == INPUT_GZIP)
+    {
+        inflateEnd(&src->gz);
+    }
+#endif
+#if HAVE_ZSTD
+    if (src->kind == INPUT_ZSTD)
+    {
+        ZSTD_freeDStream(src->zstd);
+    }
+#endif
+    free(src->in);
+    src->in = NULL;
+}
+
+#if HAVE_ZLIB
+/* Inflates into dst; several gzip members in a row are read as one
+ * stream, as gunzip does. */
+static size_t gzipRead(struct input_source *src, char *dst, size_t n)
+{
+    z_stream *z = &src->gz;
+    z->next_out = (Bytef *)dst;
+    z->avail_out = (uInt)(n < UINT_MAX ? n : UINT_MAX);
+    uInt wanted = z->avail_out;
+    while (z->avail_out == wanted && !src->finished)
+    {
+        if (z->avail_in == 0)
+        {
+            if (src->file != NULL)
+            {
+                z->next_in = src->in;
+                z->avail_in = (uInt)rawRead(src, src->in, COMPRESSED_INPUT_SIZE);
+            }
+            else
+            {
+                size_t left = src->size - src->pos;
+                z->next_in = (Bytef *)(src->data + src->pos);
+                z->avail_in = (uInt)(left < UINT_MAX ? left : UINT_MAX);
+                src->pos += z->avail_in;
+            }
+        }
+        //called even without input: output can be pending from the last call
+        uInt had_input = z->avail_in;
+        int ret = inflate(z, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+        {
+            inflateReset(z);        //another member may follow
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            src->finished = 1;
+            src->failed = 1;
+        }
+        else if (had_input == 0 && z->avail_out == wanted)
+        {
+            src->finished = 1;
+            src->failed = z->total_in > 0;      //ended inside a member
+        }
+    }
+    return wanted - z->avail_out;
+}
+#endif
+
+#if HAVE_ZSTD
+/* Decompresses into dst; consecutive frames are decoded in turn. */
+static size_t zstdRead(struct input_source *src, char *dst, size_t n)
+{
+    ZSTD_outBuffer out = { dst, n, 0 };
+    while (out.pos == 0 && !src->finished)
+    {
+        if (src->zin.pos == src->zin.size && src->file != NULL)
+        {
+            src->zin.size = rawRead(src, src->in, COMPRESSED_INPUT_SIZE);
+            src->zin.pos = 0;
+        }
+        //called even without input: output can be pending from the last call
+        int had_input = src->zin.pos < src->zin.size;
+        size_t hint = ZSTD_decompressStream(src->zstd, &out, &src->zin);
+        if (ZSTD_isError(hint))
+        {
+            src->finished = 1;
+            src->failed = 1;
+        }
+        else if (!had_input && out.pos == 0)
+        {
+            src->finished = 1;
+            src->failed = src->zstd_hint != 0;      //ended inside a frame
+        }
+        else
+        {
+            src->zstd_hint = hint;
+        }
+    }
+    return out.pos;
+}
+#endif
+
+/* Reads up to n bytes of text from src. Returns 0 at the end. */
+static size_t sourceRead(struct input_source *src, char *dst, size_t n)
+{
+    switch (src->kind)
+    {
+#if HAVE_ZLIB
+    case INPUT_GZIP:
+        return gzipRead(src, dst, n);
+#endif
+#if HAVE_ZSTD
+    case INPUT_ZSTD:
+        return zstdRead(src, dst, n);
+#endif
+    default:
+        return rawRead(src, dst, n);
+    }
+}
+
+/* The partial lines at either end of a stream that is one piece of a
+ * longer input (a zstd frame decoded on its own). head holds the text
+ * before the first newline, tail the text after the last; both are left
+ * for the caller to join with the neighbouring pieces. */
+struct stream_edges {
+    char *head;
+    size_t head_len;
+    int head_done;                  //a newline ended the head
+    int head_overlong;
+    char *tail;
+    size_t tail_len;
+};
+
+/***********************
+*Streams src through a fixed-size buffer into table.
+*Each read is analyzed up to its last newline and the
+*partial line after it is carried to the front of
+*the buffer for the next read. With edges, the first
+*and last partial lines are stored there instead of
+*being analyzed.
+************************/
+static void analyzeStream(struct input_source *src, struct climate_table *table, struct stream_edges *edges)
+{
+    char *buffer = allocPages(STREAM_BUFFER_SIZE);
+    size_t used = 0;
+    size_t n;
+    int skipping = 0;       //inside a line longer than the buffer
+
+    for (;;)
+    {
+        STATS_ENTER(&table->stats, PHASE_IO, prev);
+        n = sourceRead(src, buffer + used, STREAM_BUFFER_SIZE - used);
+        STATS_LEAVE(&table->stats, prev);
+        if (n == 0)
+        {
+            break;
+        }
+        STATS_COUNT(&table->stats, bytes, n);
+        used += n;
+        char *start = buffer;
+        if (edges != NULL && !edges->head_done)
+        {
+            char *nl = memchr(buffer, '\n', used);
+            size_t take = nl != NULL ? (size_t)(nl - buffer) : used;
+            if (edges->head_len + take > STREAM_BUFFER_SIZE)
+            {
+                edges->head_overlong = 1;
+            }
+            else
+            {
+                edges->head = realloc(edges->head, edges->head_len + take + 1);
+                memcpy(edges->head + edges->head_len, buffer, take);
+                edges->head_len += take;
+            }
+            if (nl == NULL)
+            {
+                used = 0;
+                continue;
+            }
+            start = nl + 1;
+            edges->head_done = 1;
+        }
+        else if (skipping)
+        {
+            char *nl = memchr(buffer, '\n', used);
+            if (options.rejects != NULL)
+            {
+                fwrite(buffer, 1, nl != NULL ? (size_t)(nl + 1 - buffer) : used, options.rejects);
+            }
+            if (nl == NULL)
+            {
+                used = 0;
+                continue;
+            }
+            start = nl + 1;
+            skipping = 0;
+        }
+
+        char *last = memrchr(start, '\n', used - (size_t)(start - buffer));
+        if (last == NULL)
+        {
+            if (start == buffer && used == STREAM_BUFFER_SIZE)
+            {
+                //too long to be a record; the rest of it is copied as it streams past
+                table->rejected++;
+                STATS_COUNT(&table->stats, lines, 1);
+                STATS_COUNT(&table->stats, malformed, 1);
+                if (options.rejects != NULL)
+                {
+                    fwrite(buffer, 1, used, options.rejects);
+                }
+                skipping = 1;
+                used = 0;
+                continue;
+            }
+            memmove(buffer, start, used - (size_t)(start - buffer));
+            used -= (size_t)(start - buffer);
+            continue;
+        }
+
+        scanText(start, (size_t)(last + 1 - start), table);
+        used -= (size_t)(last + 1 - buffer);
+        memmove(buffer, last + 1, used);
+    }
+
+    if (used > 0 && !skipping)      //final line without a newline
+    {
+        if (edges != NULL)
+        {
+            edges->tail = malloc(used);
+            memcpy(edges->tail, buffer, used);
+            edges->tail_len = used;
+        }
+        else
+        {
+            scanText(buffer, used, table);
+        }
+    }
+    flushBatch(table);
+    freePages(buffer, STREAM_BUFFER_SIZE);
+}
+
+/***********************
+*Analyze file function
+*
+*Reads plain, gzip or zstd compressed text from file
+*into table.
+************************/
+void analyze_file(FILE *file, struct climate_table *table)
+{
+    struct input_source src;
+    memset(&src, 0, sizeof(src));
+    src.file = file;
+    src.peek_len = fread(src.peek, 1, sizeof(src.peek), file);
+    src.kind = inputKind(src.peek, src.peek_len);
+    if (openSource(&src) != 0)
+    {
+        return;
+    }
+    analyzeStream(&src, table, NULL);
+    if (ferror(file) || src.failed)
+    {
+        fprintf(stderr, src.failed ? "Corrupt or truncated compressed input\n" : "Error while reading input\n");
+    }
+    closeSource(&src);
+}
+
+#if HAVE_ZSTD
+static void mergeStats(struct run_stats *to, const struct run_stats *from);
+
+/* One zstd frame decoded and analyzed by a worker thread. */
+struct frame_worker {
+    pthread_t thread;
+    const unsigned char *data;
+    size_t size;
+    int failed;
+    struct climate_table table;
+    struct stream_edges edges;
+};
+
+static void *frame_worker_main(void *arg)
+{
+    struct frame_worker *worker = arg;
+    struct input_source src;
+    memset(&src, 0, sizeof(src));
+    src.kind = INPUT_ZSTD;
+    src.data = worker->data;
+    src.size = worker->size;
+    if (openSource(&src) != 0)
+    {
+        worker->failed = 1;
+        return NULL;
+    }
+    analyzeStream(&src, &worker->table, &worker->edges);
+    worker->failed = src.failed;
+    closeSource(&src);
+    return NULL;
+}
+
+/**************************************************
+*Appends len bytes to a carried partial line, which
+*is given up (and later rejected) once it is longer
+*than a stream buffer
+**************************************************/
+static void carryAppend(char **carry, size_t *carry_len, int *overlong, const char *data, size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    if (*overlong || *carry_len + len > STREAM_BUFFER_SIZE)
+    {
+        *overlong = 1;
+        return;
+    }
+    *carry = realloc(*carry, *carry_len + len + 1);
+    memcpy(*carry + *carry_len, data, len);
+    *carry_len += len;
+}
+
+/**************************************************
+*Analyzes a multi-frame zstd image with num_threads
+*workers. Frames are decoded a round of num_threads
+*at a time, each by its own worker into its own
+*table, so memory stays at one stream buffer per
+*worker. Between rounds the tables are merged in
+*frame order, and the line split across each frame
+*boundary is joined from the pieces the workers left
+*and analyzed in its place.
+**************************************************/
+static void analyzeZstdFrames(const unsigned char *data, size_t size, int num_threads, struct climate_table *table)
+{
+    struct frame_worker *workers = calloc((size_t)num_threads, sizeof(*workers));
+    char *carry = NULL;
+    size_t carry_len = 0;
+    int overlong = 0, failed = 0;
+    size_t offset = 0;
+    while (offset < size)
+    {
+        int count = 0, w;
+        while (count < num_threads && offset < size)
+        {
+            size_t frame = ZSTD_findFrameCompressedSize(data + offset, size - offset);
+            if (ZSTD_isError(frame))
+            {
+                frame = size - offset;      //damaged: decode what there is and let that report it
+            }
+            workers[count].data = data + offset;
+            workers[count].size = frame;
+            init_table(&workers[count].table);
+            memset(&workers[count].edges, 0, sizeof(workers[count].edges));
+            if (pthread_create(&workers[count].thread, NULL, frame_worker_main, &workers[count]) != 0)
+            {
+                frame_worker_main(&workers[count]);
+                workers[count].thread = pthread_self();
+            }
+            offset += frame;
+            count++;
+        }
+
+        for (w = 0; w < count; w++)
+        {
+            struct frame_worker *worker = &workers[w];
+            struct stream_edges *edges = &worker->edges;
+            if (!pthread_equal(worker->thread, pthread_self()))
+            {
+                pthread_join(worker->thread, NULL);
+            }
+            failed |= worker->failed;
+            carryAppend(&carry, &carry_len, &overlong, edges->head, edges->head_len);
+            overlong |= edges->head_overlong;
+            if (edges->head_done)
+            {
+                //the carried line is complete: it comes before this frame's records
+                if (overlong)
+                {
+                    table->rejected++;
+                }
+                else if (carry_len > 0)
+                {
+                    carry[carry_len] = '\n';
+                    analyze_buffer(carry, carry_len + 1, table);
+                }
+                carry_len = 0;
+                overlong = 0;
+                merge_states(table, &worker->table);
+                carryAppend(&carry, &carry_len, &overlong, edges->tail, edges->tail_len);
+            }
+            else
+            {
+                merge_states(table, &worker->table);
+            }
+            mergeStats(&table->stats, &worker->table.stats);
+            free_table(&worker->table);
+            free(edges->head);
+            free(edges->tail);
+        }
+    }
+
+    if (overlong)
+    {
+        table->rejected++;
+    }
+    else if (carry_len > 0)     //final line without a newline
+    {
+        carry[carry_len] = '\n';
+        analyze_buffer(carry, carry_len + 1, table);
+    }
+    if (failed)
+    {
+        fprintf(stderr, "Corrupt or truncated compressed input\n");
+    }
+    free(carry);
+    free(workers);
+}
+#endif
+
+/**************************************************
+*Analyzes a mapped file image that may be compressed.
+*Returns 0 if it was plain text (left to the caller),
+*1 if it was compressed and has been analyzed.
+**************************************************/
+int analyze_compressed(const char *data, size_t size, int num_threads, struct climate_table *table)
+{
+    enum input_kind kind = inputKind((const unsigned char *)data, size);
+    if (kind == INPUT_PLAIN)
+    {
+        return 0;
+    }
+#if HAVE_ZSTD
+    if (kind == INPUT_ZSTD && num_threads > 1)
+    {
+        analyzeZstdFrames((const unsigned char *)data, size, num_threads, table);
+        return 1;
+    }
+#endif
+    struct input_source src;
+    memset(&src, 0, sizeof(src));
+    src.kind = kind;
+    src.data = (const unsigned char *)data;
+    src.size = size;
+    (void)num_threads;
+    if (openSource(&src) == 0)
+    {
+        analyzeStream(&src, table, NULL);
+        if (src.failed)
+        {
+            fprintf(stderr, "Corrupt or truncated compressed input\n");
+        }
+        closeSource(&src);
+    }
+    return 1;
+}
+
+/**************************************************
+*Scans a whole file image without copying lines.
+*Delimiters are found with the vector scanner a
+*block at a time and records are parsed directly out
+*of data; only the bytes after the last full block
+*and a final unterminated line are copied, so the
+*scanner never reads past the end of the buffer.
+**************************************************/
+static void scanBuffer(const char *data, size_t len, struct record_sink *sink)
+{
+    struct field_scan scan;
+    uint64_t tabs, newlines;
+    size_t base = 0;
+
+    pthread_once(&scannerOnce, selectScanner);
+    scan.fields[0] = data;
+    scan.count = 1;
+    for (base = 0; base + SCAN_BLOCK <= len; base += SCAN_BLOCK)
+    {
+        scanBlock(data + base, &tabs, &newlines);
+        consumeBlock(data + base, tabs, newlines, &scan, sink);
+    }
+    if (base < len)
+    {
+        char block[SCAN_BLOCK];
+        memset(block, 0, sizeof(block));
+        memcpy(block, data + base, len - base);
+        scanScalar(block, &tabs, &newlines);
+        newlines &= (len - base == SCAN_BLOCK) ? ~0ULL : (1ULL << (len - base)) - 1;
+        tabs &= (len - base == SCAN_BLOCK) ? ~0ULL : (1ULL << (len - base)) - 1;
+        consumeBlock(data + base, tabs, newlines, &scan, sink);
+    }
+
+    //a final line without a newline is copied so the parsers see a terminator
+    const char *end = data + len;
+    if (scan.fields[0] < end)
+    {
+        char last[256];
+        size_t tail = (size_t)(end - scan.fields[0]);
+        //no record is this long, and a shortened one could still parse
+        if (tail >= sizeof(last))
+        {
+            rejectLine(scan.fields[0], end, sink->stats, sink->rejected);
+            return;
+        }
+        memcpy(last, scan.fields[0], tail);
+        last[tail] = '\n';
+        scanBuffer(last, tail + 1, sink);
+    }
+}
+
+/**************************************************
+*Analyzes a whole file image into table
+**************************************************/
+void analyze_buffer(const char *data, size_t len, struct climate_table *table)
+{
+    STATS_COUNT(&table->stats, bytes, len);
+    scanText(data, len, table);
+    flushBatch(table);
+}
+
+static void zoneNote(struct zone_entry *zone, const char *const fields[TDV_FIELDS])
+{
+    const char *cursor = fields[TDV_COL_timestamp];
+    uint64_t timestamp = (uint64_t)parseInteger(&cursor);
+    cursor = fields[TDV_COL_temperature];
+    double temperature = parseDecimal(&cursor);
+    int key = stateKey(fields[TDV_COL_code]);
+    key = key >= 0 ? key : ZONE_OTHER_STATE;
+    zone->states[key / 64] |= 1ULL << (key % 64);
+    zone->records++;
+    zone->min_timestamp = timestamp < zone->min_timestamp ? timestamp : zone->min_timestamp;
+    zone->max_timestamp = timestamp > zone->max_timestamp ? timestamp : zone->max_timestamp;
+    zone->minTemp = temperature < zone->minTemp ? temperature : zone->minTemp;
+    zone->maxTemp = temperature > zone->maxTemp ? temperature : zone->maxTemp;
+}
+
+/**************************************************
+*Returns 1 if some record of a zone may pass the
+*filters, 0 if none can. Zones without records are
+*skipped too, with any malformed lines in them.
+**************************************************/
+static int zoneWanted(const struct zone_entry *zone)
+{
+    int w, some = !options.filter_states;
+    for (w = 0; !some && w < ZONE_STATE_WORDS; w++)
+    {
+        uint64_t bits = zone->states[w];
+        while (bits != 0 && !some)
+        {
+            int slot = w * 64 + __builtin_ctzll(bits);
+            some = slot < STATE_CODE_SLOTS && options.state_wanted[slot];
+            bits &= bits - 1;
+        }
+    }
+    return some && zone->records > 0 && zone->max_timestamp >= options.from && zone->min_timestamp < options.to
+        && zone->maxTemp >= options.min_temperature && zone->minTemp <= options.max_temperature;
+}
+
+/**************************************************
+*Returns a new string holding path followed by
+*suffix. Running out of memory ends the run, as in
+*arena_alloc.
+**************************************************/
+static char *suffixedPath(const char *path, const char *suffix)
+{
+    char *joined = malloc(strlen(path) + strlen(suffix) + 1);
+    if (joined == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(joined, "%s%s", path, suffix);
+    return joined;
+}
+
+static char *zonePath(const char *path)
+{
+    return suffixedPath(path, ZONE_SUFFIX);
+}
+
+/**************************************************
+*Reads the zone map of path into map if there is one
+*for the current contents of the file. Returns 0 on
+*success, -1 if there is none or it is stale.
+**************************************************/
+static int readZoneMap(const char *path, const struct stat *source, struct zone_map *map)
+{
+    char *zone_path = zonePath(path);
+    FILE *in = fopen(zone_path, "rb");
+    if (in == NULL)
+    {
+        free(zone_path);
+        return -1;
+    }
+    struct zone_header *header = &map->header;
+    int ok = fread(header, sizeof(*header), 1, in) == 1 && memcmp(header->magic, ZONE_MAGIC, sizeof(header->magic)) == 0
+        && header->version == ZONE_VERSION && header->num_zones <= (uint64_t)source->st_size + 1;
+    if (ok && (header->source_size != (uint64_t)source->st_size
+               || header->source_mtime_sec != (int64_t)source->st_mtim.tv_sec
+               || header->source_mtime_nsec != (int64_t)source->st_mtim.tv_nsec))
+    {
+        fprintf(stderr, "Ignoring stale zone map %s\n", zone_path);
+        ok = 0;
+    }
+    if (ok)
+    {
+        uint64_t z, next = 0;
+        map->zones = malloc((header->num_zones + 1) * sizeof(*map->zones));
+        ok = fread(map->zones, sizeof(*map->zones), header->num_zones, in) == header->num_zones;
+        //the zones must tile the file, or the offsets cannot be trusted
+        for (z = 0; ok && z < header->num_zones; z++)
+        {
+            ok = map->zones[z].offset == next && map->zones[z].length <= header->source_size - next;
+            next += map->zones[z].length;
+        }
+        ok = ok && next == header->source_size;
+        if (!ok)
+        {
+            fprintf(stderr, "Ignoring unreadable zone map %s\n", zone_path);
+            free(map->zones);
+            map->zones = NULL;
+        }
+    }
+    fclose(in);
+    free(zone_path);
+    return ok ? 0 : -1;
+}
+
+/**************************************************
+*Sets up the zone map of a mapped text file: reads
+*the current one from beside it, or with --index
+*cuts the file into zones for the read to fill in.
+*Returns 0 if map can be used, -1 if the file has no
+*usable zone map (or is a cache or compressed).
+**************************************************/
+int open_zone_map(const char *path, const struct stat *source, const char *data, size_t size, struct zone_map *map)
+{
+    memset(map, 0, sizeof(*map));
+    map->path = path;
+    if (size == 0 || inputKind((const unsigned char *)data, size) != INPUT_PLAIN
+        || (size >= sizeof(CACHE_MAGIC) - 1 && memcmp(data, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1) == 0))
+    {
+        return -1;
+    }
+    if (readZoneMap(path, source, map) == 0)
+    {
+        return 0;
+    }
+    if (options.index_bytes == 0)
+    {
+        return -1;
+    }
+
+    struct zone_header *header = &map->header;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, ZONE_MAGIC, sizeof(header->magic));
+    header->version = ZONE_VERSION;
+    header->zone_bytes = (uint32_t)(options.index_bytes >> 20);
+    header->source_size = (uint64_t)source->st_size;
+    header->source_mtime_sec = (int64_t)source->st_mtim.tv_sec;
+    header->source_mtime_nsec = (int64_t)source->st_mtim.tv_nsec;
+    map->zones = calloc(size / options.index_bytes + 1, sizeof(*map->zones));
+    size_t offset = 0;
+    while (offset < size)
+    {
+        struct zone_entry *zone = &map->zones[header->num_zones++];
+        size_t take = size - offset;
+        if (take > options.index_bytes)
+        {
+            const char *nl = memchr(data + offset + options.index_bytes, '\n', take - options.index_bytes);
+            take = nl != NULL ? (size_t)(nl - (data + offset)) + 1 : take;
+        }
+        zone->offset = offset;
+        zone->length = take;
+        zone->min_timestamp = UINT64_MAX;
+        zone->minTemp = INFINITY;
+        zone->maxTemp = -INFINITY;
+        offset += take;
+    }
+    map->building = 1;
+    return 0;
+}
+
+/**************************************************
+*Writes a zone map built by this run next to its
+*file, under a temporary name that is then renamed,
+*and frees map. Returns 0 on success, -1 if a new map
+*could not be written.
+**************************************************/
+int finish_zone_map(struct zone_map *map)
+{
+    int status = 0;
+    if (map->building)
+    {
+        char *zone_path = zonePath(map->path);
+        char *tmp_path = suffixedPath(zone_path, ".tmp");
+        FILE *out = fopen(tmp_path, "wb");
+        status = out != NULL ? 0 : -1;
+        if (out != NULL)
+        {
+            fwrite(&map->header, sizeof(map->header), 1, out);
+            fwrite(map->zones, sizeof(*map->zones), map->header.num_zones, out);
+            int failed = ferror(out);
+            if (fclose(out) != 0 || failed || rename(tmp_path, zone_path) != 0)
+            {
+                unlink(tmp_path);
+                status = -1;
+            }
+        }
+        if (status != 0)
+        {
+            fprintf(stderr, "Could not write zone map %s\n", zone_path);
+        }
+        free(tmp_path);
+        free(zone_path);
+    }
+    free(map->zones);
+    map->zones = NULL;
+    return status;
+}
+
+/**************************************************
+*Analyzes a mapped text file zone by zone, skipping
+*the zones the filters exclude, or noting every
+*record in its zone while a new map is built
+**************************************************/
+static void analyzeZones(const char *data, struct zone_map *map, struct climate_table *table)
+{
+    uint64_t z;
+    for (z = 0; z < map->header.num_zones; z++)
+    {
+        struct zone_entry *zone = &map->zones[z];
+        if (!map->building && options.filtering && !zoneWanted(zone))
+        {
+            STATS_COUNT(&table->stats, zones_skipped, 1);
+            STATS_COUNT(&table->stats, filtered, zone->records);
+            continue;
+        }
+        table->zone = map->building ? zone : NULL;
+        analyze_buffer(data + zone->offset, zone->length, table);
+    }
+    table->zone = NULL;
+}
+
+/**************************************************
+*Maps a regular file and analyzes it in place. A
+*text file named path is read through its zone map,
+*if it has one or --index asks for one. Returns 0 on
+*success, -1 if the file could not be mapped (the
+*caller falls back to stdio).
+**************************************************/
+int analyze_mapped(int fd, size_t size, const char *path, struct climate_table *table)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
+    STATS_ENTER(&table->stats, PHASE_IO, prev);
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        STATS_LEAVE(&table->stats, prev);
+        return -1;
+    }
+    struct stat st;
+    struct zone_map zones;
+    int zoned = path != NULL && fstat(fd, &st) == 0 && open_zone_map(path, &st, data, size, &zones) == 0;
+    madvise(data, size, MADV_SEQUENTIAL);
+    //a filtered read through a zone map only pages in the zones it reads
+    if (!zoned || zones.building || !options.filtering)
+    {
+        madvise(data, size, MADV_WILLNEED);
+    }
+    if (options.hugepages != HUGEPAGES_NONE)
+    {
+        madvise(data, size, MADV_HUGEPAGE);
+    }
+    STATS_LEAVE(&table->stats, prev);
+    if (zoned)
+    {
+        analyzeZones(data, &zones, table);
+        finish_zone_map(&zones);
+    }
+    else if (load_cache(data, size, table) != 0      //cache files can be given directly
+             && analyze_compressed(data, size, 1, table) == 0)
+    {
+        analyze_buffer(data, size, table);
+    }
+    munmap(data, size);
+    return 0;
+}
+
+/* A cache block is its index followed by its columns, widest first so
+ * every column stays naturally aligned. */
+static size_t cacheBlockBytes(uint64_t count)
+{
+    size_t bytes = sizeof(struct cache_block)
+        + (size_t)count * ((6 + TDV_NUM_EXTRAS) * sizeof(uint64_t) + 2 * sizeof(int32_t) + 1);
+    return (bytes + 7) & ~(size_t)7;
+}
+
+/* Column pointers into one cache block. */
+struct cache_columns {
+    uint64_t count;
+    uint64_t *timestamp;
+    uint64_t *geohash;
+    double *humidity;
+    double *cloud;
+    double *pressure;
+    double *temperature;
+    double *extra[TDV_EXTRA_SLOTS];
+    int32_t *snow;
+    int32_t *lightning;
+    uint8_t *state;
+};
+
+static void cacheColumns(char *block, uint64_t count, struct cache_columns *cols)
+{
+    char *p = block + sizeof(struct cache_block);
+    cols->count = count;
+    cols->timestamp = (uint64_t *)p;
+    p += count * sizeof(uint64_t);
+    cols->geohash = (uint64_t *)p;
+    p += count * sizeof(uint64_t);
+    cols->humidity = (double *)p;
+    p += count * sizeof(double);
+    cols->cloud = (double *)p;
+    p += count * sizeof(double);
+    cols->pressure = (double *)p;
+    p += count * sizeof(double);
+    cols->temperature = (double *)p;
+    p += count * sizeof(double);
+    int e;
+    for (e = 0; e < TDV_NUM_EXTRAS; e++)
+    {
+        cols->extra[e] = (double *)p;
+        p += count * sizeof(double);
+    }
+    cols->snow = (int32_t *)p;
+    p += count * sizeof(int32_t);
+    cols->lightning = (int32_t *)p;
+    p += count * sizeof(int32_t);
+    cols->state = (uint8_t *)p;
+}
+
+struct cache_writer {
+    FILE *out;
+    struct cache_header header;
+    short slot[STATE_CODE_SLOTS];       //state code -> state index, like climate_table
+    char *block;                        //the block being filled
+    struct cache_columns cols;
+};
+
+/**************************************************
+*Returns the cache's state index for a code, adding
+*it to the header's code list if it is new
+**************************************************/
+static int cacheCodeIndex(struct cache_writer *writer, const char code[3])
+{
+    int key = stateKey(code);
+    if (key >= 0 && writer->slot[key] >= 0)
+    {
+        return writer->slot[key];
+    }
+    uint32_t i;
+    for (i = 0; key < 0 && i < writer->header.num_codes; i++)
+    {
+        if (memcmp(writer->header.codes[i], code, 2) == 0)
+        {
+            return (int)i;
+        }
+    }
+    if (writer->header.num_codes >= CACHE_MAX_CODES)
+    {
+        fprintf(stderr, "Error: too many states for a cache file (limit %d)\n", CACHE_MAX_CODES);
+        exit(EXIT_FAILURE);
+    }
+    int index = (int)writer->header.num_codes++;
+    memcpy(writer->header.codes[index], code, 2);
+    if (key >= 0)
+    {
+        writer->slot[key] = (short)index;
+    }
+    return index;
+}
+
+static void cacheFlush(struct cache_writer *writer)
+{
+    uint64_t count = writer->cols.count;
+    if (count == 0)
+    {
+        return;
+    }
+    struct cache_block index;
+    uint64_t i;
+    memset(&index, 0, sizeof(index));
+    index.count = count;
+    index.min_timestamp = UINT64_MAX;
+    for (i = 0; i < count; i++)
+    {
+        uint64_t timestamp = writer->cols.timestamp[i];
+        index.min_timestamp = timestamp < index.min_timestamp ? timestamp : index.min_timestamp;
+        index.max_timestamp = timestamp > index.max_timestamp ? timestamp : index.max_timestamp;
+        index.states[writer->cols.state[i] / 64] |= 1ULL << (writer->cols.state[i] % 64);
+    }
+
+    //the block is filled at full capacity, so compact it to count records
+    struct cache_columns packed;
+    char *out = calloc(1, cacheBlockBytes(count));
+    cacheColumns(out, count, &packed);
+    memcpy(out, &index, sizeof(index));
+    memcpy(packed.timestamp, writer->cols.timestamp, count * sizeof(uint64_t));
+    memcpy(packed.geohash, writer->cols.geohash, count * sizeof(uint64_t));
+    memcpy(packed.humidity, writer->cols.humidity, count * sizeof(double));
+    memcpy(packed.cloud, writer->cols.cloud, count * sizeof(double));
+    memcpy(packed.pressure, writer->cols.pressure, count * sizeof(double));
+    memcpy(packed.temperature, writer->cols.temperature, count * sizeof(double));
+    int e;
+    for (e = 0; e < TDV_NUM_EXTRAS; e++)
+    {
+        memcpy(packed.extra[e], writer->cols.extra[e], count * sizeof(double));
+    }
+    memcpy(packed.snow, writer->cols.snow, count * sizeof(int32_t));
+    memcpy(packed.lightning, writer->cols.lightning, count * sizeof(int32_t));
+    memcpy(packed.state, writer->cols.state, count);
+    fwrite(out, cacheBlockBytes(count), 1, writer->out);
+    free(out);
+
+    writer->header.num_records += count;
+    writer->header.num_blocks++;
+    writer->cols.count = 0;
+}
+
+static void cacheAppend(struct cache_writer *writer, const struct tdv_record *rec)
+{
+    struct cache_columns *cols = &writer->cols;
+    uint64_t i = cols->count++;
+    cols->timestamp[i] = rec->timestamp;
+    cols->geohash[i] = rec->geohash;
+    cols->humidity[i] = rec->humidity;
+    cols->cloud[i] = rec->cloud;
+    cols->pressure[i] = rec->pressure;
+    cols->temperature[i] = rec->temperature;
+    cols->snow[i] = rec->snow;
+    cols->lightning[i] = rec->lightning;
+    int e;
+    for (e = 0; e < TDV_NUM_EXTRAS; e++)
+    {
+        cols->extra[e][i] = rec->extra[e];
+    }
+    cols->state[i] = (uint8_t)cacheCodeIndex(writer, rec->code);
+    if (cols->count == CACHE_BLOCK_RECORDS)
+    {
+        cacheFlush(writer);
+    }
+}
+
+/**************************************************
+*Converts a TDV file to <path>.cache. The cache is
+*written to a temporary name and renamed into place
+*so readers never see a partial file. Returns 0 on
+*success, -1 on error.
+**************************************************/
+int build_cache(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "Could not open %s for caching (caches need a regular file).\n", path);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    char *data = NULL;
+    if (size > 0)
+    {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            fprintf(stderr, "Could not map %s.\n", path);
+            close(fd);
+            return -1;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    if (size > 0 && inputKind((const unsigned char *)data, size) != INPUT_PLAIN)
+    {
+        fprintf(stderr, "Could not cache %s: caches are built from uncompressed input.\n", path);
+        munmap(data, size);
+        return -1;
+    }
+
+    char *cache_path = suffixedPath(path, CACHE_SUFFIX);
+    char *tmp_path = suffixedPath(cache_path, ".tmp");
+
+    struct cache_writer writer;
+    memset(&writer, 0, sizeof(writer));
+    memset(writer.slot, 0xff, sizeof(writer.slot));
+    writer.out = fopen(tmp_path, "wb");
+    if (writer.out == NULL)
+    {
+        fprintf(stderr, "Could not create %s.\n", tmp_path);
+        if (data != NULL)
+        {
+            munmap(data, size);
+        }
+        free(cache_path);
+        free(tmp_path);
+        return -1;
+    }
+    memcpy(writer.header.magic, CACHE_MAGIC, sizeof(writer.header.magic));
+    writer.header.version = CACHE_VERSION;
+    writer.header.block_records = CACHE_BLOCK_RECORDS;
+    writer.header.schema = schemaId();
+    writer.header.source_size = (uint64_t)st.st_size;
+    writer.header.source_mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    writer.header.source_mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+    fwrite(&writer.header, sizeof(writer.header), 1, writer.out);    //rewritten once the counts are known
+
+    writer.block = malloc(cacheBlockBytes(CACHE_BLOCK_RECORDS));
+    cacheColumns(writer.block, CACHE_BLOCK_RECORDS, &writer.cols);
+    writer.cols.count = 0;
+
+    struct run_stats stats;     //a cache build reports nothing
+    unsigned long long rejected = 0;
+    memset(&stats, 0, sizeof(stats));
+    struct record_sink sink = { &stats, &rejected, NULL, &writer, NULL };
+    if (data != NULL)
+    {
+        scanBuffer(data, size, &sink);
+        munmap(data, size);
+    }
+    cacheFlush(&writer);
+    free(writer.block);
+
+    rewind(writer.out);
+    fwrite(&writer.header, sizeof(writer.header), 1, writer.out);
+    int failed = ferror(writer.out);
+    if (fclose(writer.out) != 0 || failed || rename(tmp_path, cache_path) != 0)
+    {
+        fprintf(stderr, "Could not write %s.\n", cache_path);
+        unlink(tmp_path);
+        free(cache_path);
+        free(tmp_path);
+        return -1;
+    }
+    printf("Cached %llu records from %s in %s\n", (unsigned long long)writer.header.num_records, path, cache_path);
+    if (rejected > 0)
+    {
+        fprintf(stderr, "Rejected %llu malformed lines in %s\n", rejected, path);
+    }
+    free(cache_path);
+    free(tmp_path);
+    return 0;
+}
+
+/**************************************************
+*Sets bit i of wanted[] for each cache state index i
+*that passes --states
+**************************************************/
+static void cacheWantedCodes(const struct cache_header *header, uint64_t wanted[CACHE_MAX_CODES / 64])
+{
+    uint32_t c;
+    memset(wanted, 0, CACHE_MAX_CODES / 8);
+    for (c = 0; c < header->num_codes; c++)
+    {
+        int key = stateKey(header->codes[c]);
+        if (!options.filter_states || (key >= 0 && options.state_wanted[key]))
+        {
+            wanted[c / 64] |= 1ULL << (c % 64);
+        }
+    }
+}
+
+/**************************************************
+*Checks a block's index against the filters. Returns
+*0 if none of its records can pass, 2 if all of them
+*do, and 1 if each record has to be tested.
+**************************************************/
+static int cacheBlockMatch(const struct cache_block *block, const uint64_t wanted[CACHE_MAX_CODES / 64])
+{
+    int w, some = 0, all = 1;
+    for (w = 0; w < CACHE_MAX_CODES / 64; w++)
+    {
+        some |= (block->states[w] & wanted[w]) != 0;
+        all &= (block->states[w] & ~wanted[w]) == 0;
+    }
+    if (!some || block->max_timestamp < options.from || block->min_timestamp >= options.to)
+    {
+        return 0;
+    }
+    return all && block->min_timestamp >= options.from && block->max_timestamp < options.to
+        && options.prefix_len == 0 && !options.filter_temperature ? 2 : 1;
+}
+
+/**************************************************
+*Returns 1 if record r of a cache block passes the
+*filters
+**************************************************/
+static int cacheRecordWanted(const struct cache_columns *cols, uint64_t r, const uint64_t wanted[CACHE_MAX_CODES / 64])
+{
+    uint64_t timestamp = cols->timestamp[r];
+    if (!((wanted[cols->state[r] / 64] >> (cols->state[r] % 64)) & 1)
+        || timestamp < options.from || timestamp >= options.to
+        || cols->temperature[r] < options.min_temperature || cols->temperature[r] > options.max_temperature)
+    {
+        return 0;
+    }
+    if (options.prefix_len > 0)
+    {
+        int len = (int)(cols->geohash[r] >> 60);
+        uint64_t bits = cols->geohash[r] & ((1ULL << 60) - 1);
+        return len >= options.prefix_len && bits >> (5 * (len - options.prefix_len)) == options.prefix_bits;
+    }
+    return 1;
+}
+
+/**************************************************
+*Adds the records of a mapped cache file to table.
+*Returns 0 on success, -1 if data is not a complete
+*cache file.
+**************************************************/
+int load_cache(const char *data, size_t size, struct climate_table *table)
+{
+    struct cache_header header;
+    if (size < sizeof(header))
+    {
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != CACHE_VERSION
+        || header.schema != schemaId() || header.num_codes > CACHE_MAX_CODES)
+    {
+        return -1;
+    }
+
+    //check every block fits before touching the table
+    size_t offset = sizeof(header);
+    uint32_t b;
+    for (b = 0; b < header.num_blocks; b++)
+    {
+        struct cache_block block;
+        if (size - offset < sizeof(block))
+        {
+            return -1;
+        }
+        memcpy(&block, data + offset, sizeof(block));
+        if (block.count > header.block_records || size - offset < cacheBlockBytes(block.count))
+        {
+            return -1;
+        }
+        struct cache_columns cols;
+        uint64_t i;
+        cacheColumns((char *)data + offset, block.count, &cols);
+        for (i = 0; i < block.count; i++)
+        {
+            if (cols.state[i] >= header.num_codes)
+            {
+                return -1;
+            }
+        }
+        offset += cacheBlockBytes(block.count);
+    }
+
+    /* Codes are listed in the order they first appear, so adding each state
+     * at its first record gives the order text parsing would. */
+    int order[CACHE_MAX_CODES];
+    int slots[CACHE_MAX_CODES];
+    uint64_t wanted[CACHE_MAX_CODES / 64];
+    uint32_t c;
+    for (c = 0; c < header.num_codes; c++)
+    {
+        order[c] = -1;
+        slots[c] = stateKey(header.codes[c]);
+    }
+    cacheWantedCodes(&header, wanted);
+
+    /* The value columns are used in place; only the state index is
+     * translated. Blocks the filters partly exclude have their passing
+     * records copied into the table's batch instead. */
+    STATS_COUNT(&table->stats, bytes, size);
+    STATS_COUNT(&table->stats, lines, header.num_records);
+    STATS_ENTER(&table->stats, PHASE_ACCUMULATE, prev);
+    struct record_batch *batch = table->batch;
+    offset = sizeof(header);
+    for (b = 0; b < header.num_blocks; b++)
+    {
+        struct cache_block block;
+        struct cache_columns cols;
+        uint64_t done;
+        memcpy(&block, data + offset, sizeof(block));
+        cacheColumns((char *)data + offset, block.count, &cols);
+        offset += cacheBlockBytes(block.count);
+        int match = options.filtering ? cacheBlockMatch(&block, wanted) : 2;
+        if (match == 0)
+        {
+            STATS_COUNT(&table->stats, blocks_skipped, 1);
+            STATS_COUNT(&table->stats, filtered, block.count);
+            continue;
+        }
+        for (done = 0; done < block.count; done += BATCH_RECORDS)
+        {
+            int n = block.count - done < BATCH_RECORDS ? (int)(block.count - done) : BATCH_RECORDS;
+            int i, kept = 0;
+            for (i = 0; i < n; i++)
+            {
+                uint64_t r = done + i;
+                if (match == 1 && !cacheRecordWanted(&cols, r, wanted))
+                {
+                    continue;
+                }
+                int s = cols.state[r];
+                if (order[s] < 0)
+                {
+                    char code[3] = { header.codes[s][0], header.codes[s][1], '\0' };
+                    order[s] = stateOrder(table, code);
+                }
+                batch->order[kept] = (short)order[s];
+                batch->slot[kept] = (short)slots[s];
+                if (match == 1)
+                {
+                    batch->timestamp[kept] = cols.timestamp[r];
+                    batch->geohash[kept] = cols.geohash[r];
+                    batch->humidity[kept] = cols.humidity[r];
+                    batch->cloud[kept] = cols.cloud[r];
+                    batch->pressure[kept] = cols.pressure[r];
+                    batch->temperature[kept] = cols.temperature[r];
+                    batch->snow[kept] = cols.snow[r];
+                    batch->lightning[kept] = cols.lightning[r];
+                    int e;
+                    for (e = 0; e < TDV_NUM_EXTRAS; e++)
+                    {
+                        batch->extra[e][kept] = cols.extra[e][r];
+                    }
+                }
+                kept++;
+            }
+            struct record_columns view = {
+                kept, batch->order, batch->slot, cols.timestamp + done, cols.geohash + done,
+                cols.humidity + done, cols.cloud + done, cols.pressure + done, cols.temperature + done,
+                cols.snow + done, cols.lightning + done, { NULL }
+            };
+            int e;
+            for (e = 0; e < TDV_NUM_EXTRAS; e++)
+            {
+                view.extra[e] = cols.extra[e] + done;
+            }
+            if (match == 1)
+            {
+                struct record_columns copied = {
+                    kept, batch->order, batch->slot, batch->timestamp, batch->geohash,
+                    batch->humidity, batch->cloud, batch->pressure, batch->temperature, batch->snow, batch->lightning, { NULL }
+                };
+                for (e = 0; e < TDV_NUM_EXTRAS; e++)
+                {
+                    copied.extra[e] = batch->extra[e];
+                }
+                view = copied;
+            }
+            STATS_COUNT(&table->stats, records, kept);
+            STATS_COUNT(&table->stats, filtered, n - kept);
+            accumulateColumns(table, &view);
+        }
+    }
+    STATS_LEAVE(&table->stats, prev);
+    return 0;
+}
+
+/**************************************************
+*Returns 1 if a cache header was built from source as
+*it is now (same size and modification time)
+**************************************************/
+static int cacheMatches(const struct cache_header *header, const struct stat *source)
+{
+    return header->source_size == (uint64_t)source->st_size
+        && header->source_mtime_sec == (int64_t)source->st_mtim.tv_sec
+        && header->source_mtime_nsec == (int64_t)source->st_mtim.tv_nsec;
+}
+
+/**************************************************
+*Analyzes path from its <path>.cache file if one
+*exists and was built from the current version of
+*path (same size and mtime). Returns 0 if the cache
+*was used, 1 if the text has to be parsed.
+**************************************************/
+int analyze_cached(const char *path, const struct stat *source, struct climate_table *table)
+{
+    char *cache_path = suffixedPath(path, CACHE_SUFFIX);
+    int fd = open(cache_path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct cache_header))
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        free(cache_path);
+        return 1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        free(cache_path);
+        return 1;
+    }
+
+    const struct cache_header *header = (const struct cache_header *)data;
+    int used = 1;
+    if (!cacheMatches(header, source))
+    {
+        fprintf(stderr, "Ignoring stale cache %s; reading %s\n", cache_path, path);
+    }
+    else
+    {
+        madvise(data, size, MADV_SEQUENTIAL);
+        used = load_cache(data, size, table) == 0 ? 0 : 1;
+        if (used != 0)
+        {
+            fprintf(stderr, "Ignoring unreadable cache %s; reading %s\n", cache_path, path);
+        }
+    }
+    munmap(data, size);
+    free(cache_path);
+    return used;
+}
+
+/**************************************************
+*Adds the totals of one state record to another
+**************************************************/
+static void mergeInfo(struct climate_info *to, const struct climate_info *from)
+{
+    to->num_records += from->num_records;
+    addCompensated(&to->avgHumidity, &to->humidityError, from->avgHumidity);
+    addCompensated(&to->temperature, &to->temperatureError, from->temperature);
+    to->lightning += from->lightning;
+    to->snow += from->snow;
+    addCompensated(&to->cloud, &to->cloudError, from->cloud);
+    addCompensated(&to->pressure, &to->pressureError, from->pressure);
+    to->humidityError += from->humidityError;
+    to->temperatureError += from->temperatureError;
+    to->cloudError += from->cloudError;
+    to->pressureError += from->pressureError;
+    int e;
+    for (e = 0; e < TDV_NUM_EXTRAS; e++)
+    {
+        addCompensated(&to->extra[e], &to->extraError[e], from->extra[e]);
+        to->extraError[e] += from->extraError[e];
+    }
+    if (from->minTemp < to->minTemp)
+    {
+        to->minTemp = from->minTemp;
+        to->minTempTimestamp = from->minTempTimestamp;
+    }
+    if (from->maxTemp > to->maxTemp)
+    {
+        to->maxTemp = from->maxTemp;
+        to->maxTempTimestamp = from->maxTempTimestamp;
+    }
+}
+
+/**************************************************
+*Adds every state in src into dst. States that dst
+*has not seen yet are appended in src order, so
+*merging partial tables in input order gives the same
+*state order as analyzing the input serially.
+**************************************************/
+void merge_states(struct climate_table *dst, const struct climate_table *src)
+{
+    int i;
+    dst->rejected += src->rejected;
+    for (i = 0; i < countStates(src); i++)
+    {
+        const struct climate_info *from = &src->states[i];
+        int order = compareOrder(dst, from->code);
+        if (order == -1)
+        {
+            order = addState(dst, from->code);
+            dst->states[order] = *from;
+        }
+        else
+        {
+            mergeInfo(&dst->states[order], from);
+        }
+
+        if (options.rollup != ROLLUP_NONE && src->rollups[i].buckets != NULL)
+        {
+            const struct time_series *series = &src->rollups[i];
+            long long b;
+            for (b = 0; b < series->length; b++)
+            {
+                struct time_bucket *bucket = rollupAt(dst, &dst->rollups[order], series->first + b);
+                if (bucket == NULL)
+                {
+                    dst->rejected += series->buckets[b].num_records;
+                    continue;
+                }
+                rollupMerge(bucket, &series->buckets[b]);
+            }
+        }
+
+        if (options.percentiles)
+        {
+            digestMerge(&dst->digests[order].temperature, &src->digests[i].temperature);
+            digestMerge(&dst->digests[order].humidity, &src->digests[i].humidity);
+        }
+
+        if (options.top > 0)
+        {
+            topMerge(&dst->extremes[order].hottest, &src->extremes[i].hottest);
+            topMerge(&dst->extremes[order].coldest, &src->extremes[i].coldest);
+        }
+    }
+
+    unsigned int n;
+    for (n = 0; n < src->geo.num_cells; n++)
+    {
+        geoMerge(dst, geoCellAt(&src->geo, n));
+    }
+}
+
+static void writeDigest(FILE *out, const struct digest *d)
+{
+    struct digest sorted = *d;
+    struct snapshot_digest rec;
+    digestCompress(&sorted);
+    memset(&rec, 0, sizeof(rec));
+    rec.total = sorted.total;
+    rec.min = sorted.min;
+    rec.max = sorted.max;
+    rec.num_centroids = (uint32_t)sorted.num_centroids;
+    fwrite(&rec, sizeof(rec), 1, out);
+    fwrite(sorted.centroids, sizeof(struct centroid), (size_t)sorted.num_centroids, out);
+}
+
+/* Reads one digest written by writeDigest() into d (if not NULL). Returns
+ * 0 on success, -1 on a short or malformed record. */
+static int readDigest(FILE *in, struct digest *d)
+{
+    struct snapshot_digest rec;
+    struct centroid centroids[DIGEST_CAPACITY];
+    if (fread(&rec, sizeof(rec), 1, in) != 1 || rec.num_centroids > DIGEST_CAPACITY
+        || fread(centroids, sizeof(struct centroid), rec.num_centroids, in) != rec.num_centroids)
+    {
+        return -1;
+    }
+    if (d != NULL)
+    {
+        d->total = rec.total;
+        d->min = rec.min;
+        d->max = rec.max;
+        d->num_centroids = (int)rec.num_centroids;
+        d->num_buffered = 0;
+        memcpy(d->centroids, centroids, rec.num_centroids * sizeof(struct centroid));
+    }
+    return 0;
+}
+
+static void writeGroup(FILE *out, int64_t key, unsigned int num_records, int lightning, double temperature,
+                       double humidity, double minTemp, double maxTemp)
+{
+    struct snapshot_group rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.key = key;
+    rec.num_records = num_records;
+    rec.lightning = lightning;
+    rec.temperature = temperature;
+    rec.humidity = humidity;
+    rec.minTemp = minTemp;
+    rec.maxTemp = maxTemp;
+    fwrite(&rec, sizeof(rec), 1, out);
+}
+
+/**************************************************
+*Reads the rollup buckets and geohash cells of a
+*snapshot into loaded. Groups in another rollup unit
+*or geohash precision than this run's are read past.
+*Returns 0 on success, -1 on a short file or a
+*bucket number no timestamp could produce.
+**************************************************/
+static int readGroups(FILE *in, const struct snapshot_header *header, struct climate_table *loaded, const char *path)
+{
+    struct snapshot_group rec;
+    uint64_t count, g;
+    uint32_t i;
+    int rollups = (header->flags & SNAPSHOT_ROLLUPS) && header->rollup_unit == (uint32_t)options.rollup;
+    int cells = (header->flags & SNAPSHOT_CELLS) && header->geohash_precision == (uint32_t)options.geohash_precision;
+
+    for (i = 0; (header->flags & SNAPSHOT_ROLLUPS) && i < header->num_states; i++)
+    {
+        if (fread(&count, sizeof(count), 1, in) != 1)
+        {
+            return -1;
+        }
+        for (g = 0; g < count; g++)
+        {
+            if (fread(&rec, sizeof(rec), 1, in) != 1)
+            {
+                return -1;
+            }
+            if (rollups && options.rollup != ROLLUP_NONE)
+            {
+                struct time_bucket bucket = { rec.num_records, rec.lightning, rec.temperature, rec.humidity,
+                                              rec.minTemp, rec.maxTemp };
+                struct time_bucket *to = rollupValid(rec.key) ? rollupAt(loaded, &loaded->rollups[i], rec.key) : NULL;
+                if (to == NULL)
+                {
+                    return -1;
+                }
+                rollupMerge(to, &bucket);
+            }
+        }
+    }
+    if (options.rollup != ROLLUP_NONE && !rollups && header->num_states > 0)
+    {
+        fprintf(stderr, "Snapshot %s has no rollups by this unit; the rollup covers new input only\n", path);
+    }
+
+    if (header->flags & SNAPSHOT_CELLS)
+    {
+        if (fread(&count, sizeof(count), 1, in) != 1)
+        {
+            return -1;
+        }
+        for (g = 0; g < count; g++)
+        {
+            if (fread(&rec, sizeof(rec), 1, in) != 1)
+            {
+                return -1;
+            }
+            if (cells && options.geohash_precision > 0)
+            {
+                struct geo_cell cell = { (uint64_t)rec.key, rec.num_records, rec.lightning, rec.temperature,
+                                         rec.humidity, rec.minTemp, rec.maxTemp };
+                geoMerge(loaded, &cell);
+            }
+        }
+    }
+    if (options.geohash_precision > 0 && !cells && header->num_states > 0)
+    {
+        fprintf(stderr, "Snapshot %s has no geohash cells at this precision; cells cover new input only\n", path);
+    }
+    return 0;
+}
+
+static void writeEvents(FILE *out, const struct top_events *top)
+{
+    uint64_t count = (uint64_t)top->count;
+    int e;
+    fwrite(&count, sizeof(count), 1, out);
+    for (e = 0; e < top->count; e++)
+    {
+        struct snapshot_event rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.key = top->heap[e].key;
+        rec.timestamp = top->heap[e].timestamp;
+        rec.geohash = top->heap[e].geohash;
+        fwrite(&rec, sizeof(rec), 1, out);
+    }
+}
+
+/**************************************************
+*Reads a list of extreme events into top, or past
+*it if top is NULL. Returns 0 on success, -1 on a
+*short file.
+**************************************************/
+static int readEvents(FILE *in, struct top_events *top)
+{
+    struct snapshot_event rec;
+    uint64_t count, e;
+    if (fread(&count, sizeof(count), 1, in) != 1)
+    {
+        return -1;
+    }
+    for (e = 0; e < count; e++)
+    {
+        if (fread(&rec, sizeof(rec), 1, in) != 1)
+        {
+            return -1;
+        }
+        if (top != NULL && rec.key >= top->floor)
+        {
+            struct extreme_event event = { rec.key, rec.timestamp, rec.geohash };
+            topOffer(top, &event);
+        }
+    }
+    return 0;
+}
+
+/**************************************************
+*Writes every state in table to a snapshot file. The
+*file is written under a temporary name and renamed
+*so an interrupted run leaves the old snapshot.
+*Returns 0 on success, -1 on error.
+**************************************************/
+int save_snapshot(const char *path, const struct climate_table *table)
+{
+    char *tmp_path = suffixedPath(path, ".tmp");
+    FILE *out = fopen(tmp_path, "wb");
+    if (out == NULL)
+    {
+        free(tmp_path);
+        return -1;
+    }
+
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.num_states = (uint32_t)countStates(table);
+    header.flags = (options.percentiles ? SNAPSHOT_DIGESTS : 0) | (options.rollup != ROLLUP_NONE ? SNAPSHOT_ROLLUPS : 0)
+        | (options.geohash_precision > 0 ? SNAPSHOT_CELLS : 0) | (options.top > 0 ? SNAPSHOT_TOP : 0);
+    header.schema = schemaId();
+    header.rollup_unit = (uint32_t)options.rollup;
+    header.geohash_precision = (uint32_t)options.geohash_precision;
+    fwrite(&header, sizeof(header), 1, out);
+
+    int i;
+    for (i = 0; i < countStates(table); i++)
+    {
+        const struct climate_info *info = &table->states[i];
+        struct snapshot_state rec;
+        memset(&rec, 0, sizeof(rec));
+        memcpy(rec.code, info->code, sizeof(info->code));
+        rec.num_records = info->num_records;
+        rec.lightning = info->lightning;
+        rec.snow = info->snow;
+        rec.avgHumidity = info->avgHumidity;
+        rec.temperature = info->temperature;
+        rec.cloud = info->cloud;
+        rec.pressure = info->pressure;
+        rec.humidityError = info->humidityError;
+        rec.temperatureError = info->temperatureError;
+        rec.cloudError = info->cloudError;
+        rec.pressureError = info->pressureError;
+        rec.maxTemp = info->maxTemp;
+        rec.minTemp = info->minTemp;
+        rec.maxTempTimestamp = info->maxTempTimestamp;
+        rec.minTempTimestamp = info->minTempTimestamp;
+        fwrite(&rec, sizeof(rec), 1, out);
+        fwrite(info->extra, sizeof(double), TDV_NUM_EXTRAS, out);
+        fwrite(info->extraError, sizeof(double), TDV_NUM_EXTRAS, out);
+    }
+
+    for (i = 0; options.percentiles && i < countStates(table); i++)
+    {
+        writeDigest(out, &table->digests[i].temperature);
+        writeDigest(out, &table->digests[i].humidity);
+    }
+
+    for (i = 0; options.rollup != ROLLUP_NONE && i < countStates(table); i++)
+    {
+        const struct time_series *series = &table->rollups[i];
+        uint64_t used = 0;
+        long long b;
+        for (b = 0; b < series->length; b++)
+        {
+            used += series->buckets[b].num_records > 0;
+        }
+        fwrite(&used, sizeof(used), 1, out);
+        for (b = 0; b < series->length; b++)
+        {
+            const struct time_bucket *bucket = &series->buckets[b];
+            if (bucket->num_records > 0)
+            {
+                writeGroup(out, series->first + b, bucket->num_records, bucket->lightning, bucket->temperature,
+                           bucket->humidity, bucket->minTemp, bucket->maxTemp);
+            }
+        }
+    }
+
+    if (options.geohash_precision > 0)
+    {
+        uint64_t count = table->geo.num_cells;
+        unsigned int n;
+        fwrite(&count, sizeof(count), 1, out);
+        for (n = 0; n < table->geo.num_cells; n++)
+        {
+            const struct geo_cell *cell = geoCellAt(&table->geo, n);
+            writeGroup(out, (int64_t)cell->key, cell->num_records, cell->lightning, cell->temperature,
+                       cell->humidity, cell->minTemp, cell->maxTemp);
+        }
+    }
+
+    for (i = 0; options.top > 0 && i < countStates(table); i++)
+    {
+        writeEvents(out, &table->extremes[i].hottest);
+        writeEvents(out, &table->extremes[i].coldest);
+    }
+
+    int failed = ferror(out);
+    if (fclose(out) != 0 || failed || rename(tmp_path, path) != 0)
+    {
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+    return 0;
+}
+
+/**************************************************
+*Merges the states in a snapshot file into table.
+*Returns 0 on success, -1 if the file is missing or
+*is not a snapshot (table is left unchanged).
+**************************************************/
+int load_snapshot(const char *path, struct climate_table *table)
+{
+    FILE *in = fopen(path, "rb");
+    if (in == NULL)
+    {
+        return -1;
+    }
+
+    struct snapshot_header header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+        || header.version != SNAPSHOT_VERSION || header.schema != schemaId() || header.num_states > NUM_STATES)
+    {
+        fclose(in);
+        return -1;
+    }
+
+    struct climate_table loaded;
+    init_table(&loaded);
+    uint32_t i;
+    for (i = 0; i < header.num_states; i++)
+    {
+        struct snapshot_state rec;
+        double extra[TDV_EXTRA_SLOTS] = { 0 }, extraError[TDV_EXTRA_SLOTS] = { 0 };
+        if (fread(&rec, sizeof(rec), 1, in) != 1 || fread(extra, sizeof(double), TDV_NUM_EXTRAS, in) != TDV_NUM_EXTRAS
+            || fread(extraError, sizeof(double), TDV_NUM_EXTRAS, in) != TDV_NUM_EXTRAS)
+        {
+            free_table(&loaded);
+            fclose(in);
+            return -1;
+        }
+        rec.code[2] = '\0';
+        struct climate_info *info = &loaded.states[addState(&loaded, rec.code)];
+        info->num_records = rec.num_records;
+        info->lightning = rec.lightning;
+        info->snow = rec.snow;
+        info->avgHumidity = rec.avgHumidity;
+        info->temperature = rec.temperature;
+        info->cloud = rec.cloud;
+        info->pressure = rec.pressure;
+        info->humidityError = rec.humidityError;
+        info->temperatureError = rec.temperatureError;
+        info->cloudError = rec.cloudError;
+        info->pressureError = rec.pressureError;
+        info->maxTemp = rec.maxTemp;
+        info->minTemp = rec.minTemp;
+        info->maxTempTimestamp = rec.maxTempTimestamp;
+        info->minTempTimestamp = rec.minTempTimestamp;
+        memcpy(info->extra, extra, sizeof(extra));
+        memcpy(info->extraError, extraError, sizeof(extraError));
+    }
+
+    //sketches are read even when this run does not report percentiles
+    if (header.flags & SNAPSHOT_DIGESTS)
+    {
+        for (i = 0; i < header.num_states; i++)
+        {
+            struct state_digests *digests = options.percentiles ? &loaded.digests[i] : NULL;
+            if (readDigest(in, digests != NULL ? &digests->temperature : NULL) != 0
+                || readDigest(in, digests != NULL ? &digests->humidity : NULL) != 0)
+            {
+                free_table(&loaded);
+                fclose(in);
+                return -1;
+            }
+        }
+    }
+    else if (options.percentiles && header.num_states > 0)
+    {
+        fprintf(stderr, "Snapshot %s has no percentile sketches; percentiles cover new input only\n", path);
+    }
+    if (readGroups(in, &header, &loaded, path) != 0)
+    {
+        free_table(&loaded);
+        fclose(in);
+        return -1;
+    }
+    for (i = 0; (header.flags & SNAPSHOT_TOP) && i < header.num_states; i++)
+    {
+        struct state_extremes *extremes = options.top > 0 ? &loaded.extremes[i] : NULL;
+        if (readEvents(in, extremes != NULL ? &extremes->hottest : NULL) != 0
+            || readEvents(in, extremes != NULL ? &extremes->coldest : NULL) != 0)
+        {
+            free_table(&loaded);
+            fclose(in);
+            return -1;
+        }
+    }
+    if (options.top > 0 && !(header.flags & SNAPSHOT_TOP) && header.num_states > 0)
+    {
+        fprintf(stderr, "Snapshot %s has no extreme events; the top readings cover new input only\n", path);
+    }
+    fclose(in);
+
+    STATS_ENTER(&table->stats, PHASE_MERGE, prev);
+    merge_states(table, &loaded);
+    STATS_LEAVE(&table->stats, prev);
+    free_table(&loaded);
+    return 0;
+}
+
+/**************************************************
+*Adds a worker's counters and phase times to another
+*table's (phase times become sums over threads)
+**************************************************/
+static void mergeStats(struct run_stats *to, const struct run_stats *from)
+{
+    int p;
+    to->bytes += from->bytes;
+    to->lines += from->lines;
+    to->records += from->records;
+    to->malformed += from->malformed;
+    to->filtered += from->filtered;
+    to->chunks += from->chunks;
+    to->steals += from->steals;
+    to->remote_steals += from->remote_steals;
+    to->blocks_skipped += from->blocks_skipped;
+    to->zones_skipped += from->zones_skipped;
+    to->state_misses += from->state_misses;
+    to->parse_ticks += from->parse_ticks;
+    to->lookup_ticks += from->lookup_ticks;
+    for (p = 0; p < NUM_PHASES; p++)
+    {
+        to->wall[p] += from->wall[p];
+        to->cpu[p] += from->cpu[p];
+    }
+}
+
+/* One command line file as opened by the prefetch thread. */
+struct prefetch_file {
+    int fd;
+    int regular;
+    int released;                   //main() has moved past it
+    size_t ahead;                   //bytes read ahead for it
+    struct stat st;
+};
+
+struct prefetcher {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char *const *paths;
+    int num_paths;
+    struct prefetch_file *files;
+    int opened;                     //files[0..opened) are ready to take
+    int taken;                      //main() has taken files[0..taken)
+    size_t ahead;                   //bytes read ahead for unreleased files
+};
+
+/**************************************************
+*Reads one file into the page cache a chunk at a
+*time, waiting whenever the prefetcher is
+*PREFETCH_BYTES ahead. Stops early if main() is done
+*with the file, so a file is never read twice.
+**************************************************/
+static void prefetchContents(struct prefetcher *prefetch, struct prefetch_file *file, int fd, off_t size)
+{
+    off_t offset;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (offset = 0; offset < size; offset += (off_t)PREFETCH_CHUNK)
+    {
+        pthread_mutex_lock(&prefetch->lock);
+        while (prefetch->ahead >= PREFETCH_BYTES && !file->released)
+        {
+            pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+        }
+        int stop = file->released;
+        if (!stop)
+        {
+            prefetch->ahead += PREFETCH_CHUNK;
+            file->ahead += PREFETCH_CHUNK;
+        }
+        pthread_mutex_unlock(&prefetch->lock);
+        if (stop)
+        {
+            return;
+        }
+        posix_fadvise(fd, offset, (off_t)PREFETCH_CHUNK, POSIX_FADV_WILLNEED);
+        readahead(fd, offset, PREFETCH_CHUNK);
+    }
+}
+
+static void *prefetch_main(void *arg)
+{
+    struct prefetcher *prefetch = arg;
+    int n;
+    for (n = 0; n < prefetch->num_paths; n++)
+    {
+        struct prefetch_file *file = &prefetch->files[n];
+        const char *path = prefetch->paths[n];
+
+        pthread_mutex_lock(&prefetch->lock);
+        while (n - prefetch->taken >= PREFETCH_FILES)
+        {
+            pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+        }
+        pthread_mutex_unlock(&prefetch->lock);
+
+        file->fd = -1;
+        if (strcmp(path, "-") != 0)
+        {
+            file->fd = open(path, O_RDONLY);
+            file->regular = file->fd != -1 && fstat(file->fd, &file->st) == 0 && S_ISREG(file->st.st_mode);
+        }
+        pthread_mutex_lock(&prefetch->lock);
+        prefetch->opened = n + 1;
+        pthread_cond_broadcast(&prefetch->changed);
+        pthread_mutex_unlock(&prefetch->lock);
+        if (!file->regular)
+        {
+            continue;
+        }
+
+        //an up-to-date cache is what will be read, so warm that instead
+        char *cache_path = suffixedPath(path, CACHE_SUFFIX);
+        int cache_fd = open(cache_path, O_RDONLY);
+        free(cache_path);
+        struct cache_header header;
+        struct stat cache_st;
+        if (cache_fd != -1 && fstat(cache_fd, &cache_st) == 0
+            && pread(cache_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+            && cacheMatches(&header, &file->st))
+        {
+            prefetchContents(prefetch, file, cache_fd, cache_st.st_size);
+        }
+        else
+        {
+            prefetchContents(prefetch, file, file->fd, file->st.st_size);
+        }
+        if (cache_fd != -1)
+        {
+            close(cache_fd);
+        }
+    }
+    return NULL;
+}
+
+/**************************************************
+*Starts prefetching paths in order. Returns NULL if
+*the thread could not be started (the caller opens
+*the files itself).
+**************************************************/
+struct prefetcher *start_prefetch(char *const paths[], int num_paths)
+{
+    struct prefetcher *prefetch = calloc(1, sizeof(*prefetch));
+    prefetch->paths = paths;
+    prefetch->num_paths = num_paths;
+    prefetch->files = calloc((size_t)num_paths, sizeof(*prefetch->files));
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->changed, NULL);
+    if (pthread_create(&prefetch->thread, NULL, prefetch_main, prefetch) != 0)
+    {
+        pthread_mutex_destroy(&prefetch->lock);
+        pthread_cond_destroy(&prefetch->changed);
+        free(prefetch->files);
+        free(prefetch);
+        return NULL;
+    }
+    return prefetch;
+}
+
+/**************************************************
+*Waits for file n to be opened and hands its
+*descriptor (-1 if it could not be opened, or for -)
+*to the caller, which closes it. Taking file n means
+*the caller is done with every earlier file.
+**************************************************/
+int prefetch_take(struct prefetcher *prefetch, int n, struct stat *st, int *regular)
+{
+    int i;
+    pthread_mutex_lock(&prefetch->lock);
+    while (prefetch->opened <= n)
+    {
+        pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (!prefetch->files[i].released)
+        {
+            prefetch->files[i].released = 1;
+            prefetch->ahead -= prefetch->files[i].ahead;
+        }
+    }
+    prefetch->taken = n + 1;
+    pthread_cond_broadcast(&prefetch->changed);
+    pthread_mutex_unlock(&prefetch->lock);
+
+    *st = prefetch->files[n].st;
+    *regular = prefetch->files[n].regular;
+    return prefetch->files[n].fd;
+}
+
+/**************************************************
+*Stops prefetching once every file has been taken
+**************************************************/
+void finish_prefetch(struct prefetcher *prefetch)
+{
+    int i;
+    pthread_mutex_lock(&prefetch->lock);
+    for (i = 0; i < prefetch->num_paths; i++)
+    {
+        prefetch->files[i].released = 1;
+    }
+    prefetch->ahead = 0;
+    pthread_cond_broadcast(&prefetch->changed);
+    pthread_mutex_unlock(&prefetch->lock);
+    pthread_join(prefetch->thread, NULL);
+    pthread_mutex_destroy(&prefetch->lock);
+    pthread_cond_destroy(&prefetch->changed);
+    free(prefetch->files);
+    free(prefetch);
+}
+
+/* -j cuts the mapped input into newline-aligned chunks of about
+ * total / (num_threads * INGEST_CHUNKS_PER_WORKER) bytes, within
+ * INGEST_MIN_CHUNK..INGEST_MAX_CHUNK, and never across files. */
+#define INGEST_CHUNKS_PER_WORKER 8
+#define INGEST_MIN_CHUNK ((size_t)256 << 10)
+#define INGEST_MAX_CHUNK ((size_t)4 << 20)
+
+/* A newline-aligned slice of one input file. */
+struct ingest_chunk {
+    const char *data;
+    size_t len;
+    struct chunk_states states;
+    struct zone_entry *zone;        //--index: the zone map entry this chunk fills in
+};
+
+/* --numa spreads the workers over the online NUMA nodes, in runs of
+ * consecutive workers, so neighbouring chunks are read on the same node. */
+#define NUMA_MAX_NODES 64
+
+struct numa_nodes {
+    int count;
+    cpu_set_t cpus[NUMA_MAX_NODES];     //the CPUs of each node this process may use
+};
+
+struct ingest_pool;
+
+/* Each worker starts with a run of consecutive chunks and has a private
+ * states table. It takes chunks from the front of its run; once that is
+ * empty it steals from the back of the longest remaining run, preferring
+ * workers on its own node. */
+struct ingest_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;           //guards next and end
+    int next;
+    int end;
+    int node;
+    const cpu_set_t *cpus;          //--numa: the worker is pinned to these
+    struct shared_table *shared;    //--shared: the table of the worker's node
+    struct ingest_pool *pool;
+    struct climate_table table;
+};
+
+struct ingest_pool {
+    struct ingest_chunk *chunks;
+    int num_chunks;
+    struct ingest_worker *workers;
+    int num_workers;
+    int num_nodes;
+};
+
+/**************************************************
+*Adds a sysfs CPU or node list such as "0-3,8-11" to
+*set. Returns the number of entries added.
+**************************************************/
+static int parseCpuList(const char *text, cpu_set_t *set)
+{
+    int added = 0;
+    while (*text >= '0' && *text <= '9')
+    {
+        char *end;
+        long first = strtol(text, &end, 10);
+        long last = first;
+        if (*end == '-')
+        {
+            last = strtol(end + 1, &end, 10);
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++)
+        {
+            CPU_SET((int)first, set);
+            added++;
+        }
+        text = *end == ',' ? end + 1 : end;
+    }
+    return added;
+}
+
+static int readCpuList(const char *path, cpu_set_t *set)
+{
+    char line[4096];
+    CPU_ZERO(set);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    int added = fgets(line, sizeof(line), file) != NULL ? parseCpuList(line, set) : 0;
+    fclose(file);
+    return added;
+}
+
+/**************************************************
+*Fills in the online NUMA nodes that have a CPU this
+*process may run on. Returns their count, or 0 if the
+*kernel reports no NUMA topology.
+**************************************************/
+static int numaNodes(struct numa_nodes *nodes)
+{
+    cpu_set_t online, allowed;
+    nodes->count = 0;
+    if (readCpuList("/sys/devices/system/node/online", &online) == 0
+        || sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return 0;
+    }
+    int node;
+    for (node = 0; node < CPU_SETSIZE && nodes->count < NUMA_MAX_NODES; node++)
+    {
+        char path[64];
+        cpu_set_t *cpus = &nodes->cpus[nodes->count];
+        if (!CPU_ISSET(node, &online))
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (readCpuList(path, cpus) > 0)
+        {
+            CPU_AND(cpus, cpus, &allowed);
+            nodes->count += CPU_COUNT(cpus) > 0;
+        }
+    }
+    return nodes->count;
+}
+
+/**************************************************
+*Returns the next chunk for a worker: its own next
+*one, or the last one of the worker with the most
+*left, looking on the worker's own node first.
+*Returns -1 when every queue is empty; queues only
+*shrink, so the worker can stop then.
+**************************************************/
+static int takeChunk(struct ingest_worker *worker)
+{
+    int chunk = -1;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->next < worker->end)
+    {
+        chunk = worker->next;
+        __atomic_store_n(&worker->next, chunk + 1, __ATOMIC_RELAXED);      //peeked at by thieves
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    while (chunk == -1)
+    {
+        struct ingest_pool *pool = worker->pool;
+        struct ingest_worker *victim = NULL;
+        int most = 0, w, pass;
+        for (pass = pool->num_nodes > 1 ? 0 : 1; pass < 2 && victim == NULL; pass++)
+        {
+            for (w = 0; w < pool->num_workers; w++)
+            {
+                if (pass == 0 && pool->workers[w].node != worker->node)
+                {
+                    continue;
+                }
+                //an unlocked peek only picks the victim; the take is checked under its lock
+                int left = __atomic_load_n(&pool->workers[w].end, __ATOMIC_RELAXED)
+                         - __atomic_load_n(&pool->workers[w].next, __ATOMIC_RELAXED);
+                if (left > most)
+                {
+                    most = left;
+                    victim = &pool->workers[w];
+                }
+            }
+        }
+        if (victim == NULL)
+        {
+            return -1;
+        }
+        pthread_mutex_lock(&victim->lock);
+        if (victim->next < victim->end)
+        {
+            chunk = victim->end - 1;
+            __atomic_store_n(&victim->end, chunk, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (chunk != -1)
+        {
+            STATS_COUNT(&worker->table.stats, steals, 1);
+            STATS_COUNT(&worker->table.stats, remote_steals, victim->node != worker->node);
+        }
+    }
+    return chunk;
+}
+
+/**************************************************
+*Runs one worker. The worker sets up its own table,
+*after pinning itself with --numa, so the arena pages
+*are first touched, and placed, on its node; its run
+*of chunks is read in from there too.
+**************************************************/
+static void *ingest_worker_main(void *arg)
+{
+    struct ingest_worker *worker = arg;
+    int c;
+    if (worker->cpus != NULL && pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), worker->cpus) == 0)
+    {
+        pthread_mutex_lock(&worker->lock);
+        for (c = worker->next; c < worker->end; c++)
+        {
+            const struct ingest_chunk *chunk = &worker->pool->chunks[c];
+            size_t lead = (uintptr_t)chunk->data & (uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+            madvise((char *)chunk->data - lead, chunk->len + lead, MADV_WILLNEED);
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+    init_table(&worker->table);
+    worker->table.shared = worker->shared;
+    while ((c = takeChunk(worker)) != -1)
+    {
+        struct ingest_chunk *chunk = &worker->pool->chunks[c];
+        worker->table.first_seen = &chunk->states;
+        worker->table.zone = chunk->zone;
+        analyze_buffer(chunk->data, chunk->len, &worker->table);
+        STATS_COUNT(&worker->table.stats, chunks, 1);
+    }
+    worker->table.first_seen = NULL;
+    worker->table.zone = NULL;
+    return NULL;
+}
+
+/**************************************************
+*Allocates the index and groups of a shared table if
+*wanted. Returns 0 on success, -1 if out of memory.
+**************************************************/
+static int sharedAllocate(struct shared_groups *groups, int wanted)
+{
+    if (!wanted)
+    {
+        return 0;
+    }
+    groups->index = allocPages(SHARED_INDEX_SLOTS * sizeof(uint32_t));
+    groups->groups = allocPages(SHARED_MAX_GROUPS * sizeof(struct shared_group));
+    return groups->index != NULL && groups->groups != NULL ? 0 : -1;
+}
+
+static void freeShared(struct shared_table *shared)
+{
+    freePages(shared->geo.index, SHARED_INDEX_SLOTS * sizeof(uint32_t));
+    freePages(shared->geo.groups, SHARED_MAX_GROUPS * sizeof(struct shared_group));
+    freePages(shared->rollup.index, SHARED_INDEX_SLOTS * sizeof(uint32_t));
+    freePages(shared->rollup.groups, SHARED_MAX_GROUPS * sizeof(struct shared_group));
+}
+
+/**************************************************
+*Adds the cells and buckets of a --shared table to
+*table. Runs after the workers have been merged, so
+*the state of every bucket is already in table.
+**************************************************/
+static void mergeShared(struct climate_table *table, const struct shared_table *shared)
+{
+    unsigned int n;
+    unsigned int geoUsed = shared->geo.used < SHARED_MAX_GROUPS ? shared->geo.used : SHARED_MAX_GROUPS;
+    unsigned int rollupUsed = shared->rollup.used < SHARED_MAX_GROUPS ? shared->rollup.used : SHARED_MAX_GROUPS;
+    for (n = 0; n < geoUsed; n++)
+    {
+        const struct shared_group *group = &shared->geo.groups[n];
+        if (group->key == 0)
+        {
+            continue;
+        }
+        struct geo_cell cell;
+        cell.key = group->key;
+        cell.num_records = group->num_records;
+        cell.lightning = group->lightning;
+        memcpy(&cell.temperature, &group->temperature, sizeof(double));
+        memcpy(&cell.humidity, &group->humidity, sizeof(double));
+        cell.minTemp = orderedValue(~group->minKey);
+        cell.maxTemp = orderedValue(group->maxKey);
+        geoMerge(table, &cell);
+    }
+    for (n = 0; n < rollupUsed; n++)
+    {
+        const struct shared_group *group = &shared->rollup.groups[n];
+        if (group->key == 0)
+        {
+            continue;
+        }
+        int order = table->slot[(group->key >> 48) - 1];
+        long long bucket = (long long)(group->key << 16) >> 16;     //sign-extends the 48-bit number
+        struct time_bucket one;
+        one.num_records = group->num_records;
+        one.lightning = group->lightning;
+        memcpy(&one.temperature, &group->temperature, sizeof(double));
+        memcpy(&one.humidity, &group->humidity, sizeof(double));
+        one.minTemp = orderedValue(~group->minKey);
+        one.maxTemp = orderedValue(group->maxKey);
+        struct time_bucket *to = rollupAt(table, &table->rollups[order], bucket);
+        if (to == NULL)
+        {
+            table->rejected += one.num_records;
+            continue;
+        }
+        rollupMerge(to, &one);
+    }
+}
+
+/**************************************************
+*Analyzes a set of mapped files with num_threads
+*workers. The input is cut into chunks and each
+*worker starts with an equal run of them, stealing
+*from the others once its own run is done, so the
+*slowest worker is at most one chunk behind. Each
+*worker aggregates into a thread-local table. The
+*states are then added to table in the order of their
+*first record and the tables merged into it. With
+*--shared the cells and buckets are added to one
+*shared table instead and folded into table once.
+*With --numa the workers are pinned to nodes and
+*each node has its own shared table; nothing is
+*merged across nodes until every worker is done.
+*Files with a zone map (zones may be NULL) are cut
+*at its zones instead, less those the filters skip.
+**************************************************/
+void analyze_parallel(const char *data[], const size_t sizes[], struct zone_map zones[], int num_files,
+                      int num_threads, struct climate_table *table)
+{
+    size_t total = 0;
+    int f, w, c;
+    for (f = 0; f < num_files; f++)
+    {
+        total += sizes[f];
+    }
+    size_t target = total / ((size_t)num_threads * INGEST_CHUNKS_PER_WORKER) + 1;
+    target = target < INGEST_MIN_CHUNK ? INGEST_MIN_CHUNK : target > INGEST_MAX_CHUNK ? INGEST_MAX_CHUNK : target;
+
+    /* Every file ends at most one chunk early, so this bounds the count. */
+    struct ingest_pool pool;
+    size_t bound = (size_t)num_files + 1;
+    for (f = 0; f < num_files; f++)
+    {
+        bound += zones != NULL && zones[f].zones != NULL ? zones[f].header.num_zones : sizes[f] / target;
+    }
+    pool.chunks = calloc(bound, sizeof(*pool.chunks));
+    pool.num_chunks = 0;
+    for (f = 0; f < num_files; f++)
+    {
+        size_t offset = 0;
+        if (zones != NULL && zones[f].zones != NULL)
+        {
+            struct zone_map *map = &zones[f];
+            uint64_t z;
+            for (z = 0; z < map->header.num_zones; z++)
+            {
+                struct zone_entry *zone = &map->zones[z];
+                if (!map->building && options.filtering && !zoneWanted(zone))
+                {
+                    STATS_COUNT(&table->stats, zones_skipped, 1);
+                    STATS_COUNT(&table->stats, filtered, zone->records);
+                    continue;
+                }
+                pool.chunks[pool.num_chunks].data = data[f] + zone->offset;
+                pool.chunks[pool.num_chunks].len = zone->length;
+                pool.chunks[pool.num_chunks].zone = map->building ? zone : NULL;
+                pool.num_chunks++;
+            }
+            continue;
+        }
+        while (offset < sizes[f])
+        {
+            size_t take = sizes[f] - offset;
+            if (take > target)
+            {
+                const char *nl = memchr(data[f] + offset + target, '\n', take - target);
+                take = nl != NULL ? (size_t)(nl - (data[f] + offset)) + 1 : take;
+            }
+            pool.chunks[pool.num_chunks].data = data[f] + offset;
+            pool.chunks[pool.num_chunks].len = take;
+            pool.num_chunks++;
+            offset += take;
+        }
+    }
+
+    /* Without --numa every worker counts as on node 0. */
+    struct numa_nodes nodes;
+    int pinning = options.numa && numaNodes(&nodes) > 0;
+    pool.num_nodes = !pinning ? 1 : nodes.count < num_threads ? nodes.count : num_threads;
+
+    /* With --shared, cells and buckets go to one table per node; its pages
+     * stay untouched until a group is claimed, so they are placed on the
+     * node of the worker that claims them. */
+    struct shared_table *shared = NULL;
+    int n, num_shared = 0;
+    if (options.shared && num_threads > 1 && (options.geohash_precision > 0 || options.rollup != ROLLUP_NONE))
+    {
+        shared = calloc((size_t)pool.num_nodes, sizeof(*shared));
+        for (num_shared = 0; num_shared < pool.num_nodes; num_shared++)
+        {
+            if (sharedAllocate(&shared[num_shared].geo, options.geohash_precision > 0) != 0
+                || sharedAllocate(&shared[num_shared].rollup, options.rollup != ROLLUP_NONE) != 0)
+            {
+                freeShared(&shared[num_shared]);
+                break;
+            }
+        }
+        if (num_shared < pool.num_nodes)
+        {
+            for (n = 0; n < num_shared; n++)
+            {
+                freeShared(&shared[n]);
+            }
+            free(shared);
+            shared = NULL;
+        }
+    }
+
+    //every queue is filled before any worker starts, so nothing is stolen early
+    pool.workers = calloc((size_t)num_threads, sizeof(*pool.workers));
+    pool.num_workers = num_threads;
+    for (w = 0; w < num_threads; w++)
+    {
+        struct ingest_worker *worker = &pool.workers[w];
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->next = (int)((long long)pool.num_chunks * w / num_threads);
+        worker->end = (int)((long long)pool.num_chunks * (w + 1) / num_threads);
+        worker->node = (int)((long long)pool.num_nodes * w / num_threads);
+        worker->cpus = pinning ? &nodes.cpus[worker->node] : NULL;
+        worker->shared = shared != NULL ? &shared[worker->node] : NULL;
+        worker->pool = &pool;
+    }
+    for (w = 0; w < num_threads; w++)
+    {
+        struct ingest_worker *worker = &pool.workers[w];
+        if (pthread_create(&worker->thread, NULL, ingest_worker_main, worker) != 0)
+        {
+            ingest_worker_main(worker);
+            worker->thread = pthread_self();
+        }
+    }
+
+    for (w = 0; w < num_threads; w++)
+    {
+        if (!pthread_equal(pool.workers[w].thread, pthread_self()))
+        {
+            pthread_join(pool.workers[w].thread, NULL);
+        }
+    }
+    STATS_ENTER(&table->stats, PHASE_MERGE, prev);
+    for (c = 0; c < pool.num_chunks; c++)
+    {
+        int i;
+        for (i = 0; i < pool.chunks[c].states.count; i++)
+        {
+            if (compareOrder(table, pool.chunks[c].states.codes[i]) == -1)
+            {
+                stateOrder(table, pool.chunks[c].states.codes[i]);
+            }
+        }
+    }
+    for (w = 0; w < num_threads; w++)
+    {
+        merge_states(table, &pool.workers[w].table);
+        mergeStats(&table->stats, &pool.workers[w].table.stats);
+        free_table(&pool.workers[w].table);
+        pthread_mutex_destroy(&pool.workers[w].lock);
+    }
+    if (shared != NULL)
+    {
+        for (n = 0; n < num_shared; n++)
+        {
+            mergeShared(table, &shared[n]);
+            freeShared(&shared[n]);
+        }
+        free(shared);
+    }
+    STATS_LEAVE(&table->stats, prev);
+    free(pool.chunks);
+    free(pool.workers);
+}
+
+/* --merge combines partial tables: snapshot files written by runs over
+ * separate shards. The partials are loaded concurrently, each into a table
+ * of its own, and then folded pairwise in rounds (0+1, 2+3, ... then 0+2,
+ * 4+6, ...), so N partials take log2(N) rounds. merge_states() appends new
+ * states in the order of its source, so the result keeps the order a
+ * serial fold of the files would give. */
+struct merge_pool {
+    char *const *paths;
+    struct climate_table *parts;
+    int stride;                     //0 while loading, then the distance between merged pairs
+    int count;                      //jobs in the current round
+    int next;                       //next job to take
+    int failed;
+};
+
+static void *merge_worker_main(void *arg)
+{
+    struct merge_pool *pool = arg;
+    int job;
+    while ((job = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count)
+    {
+        if (pool->stride == 0)
+        {
+            if (load_snapshot(pool->paths[job], &pool->parts[job]) != 0)
+            {
+                fprintf(stderr, "Could not load partial %s\n", pool->paths[job]);
+                __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+            }
+            continue;
+        }
+        struct climate_table *dst = &pool->parts[job * 2 * pool->stride];
+        merge_states(dst, dst + pool->stride);
+        free_table(dst + pool->stride);
+    }
+    return NULL;
+}
+
+/* Runs count jobs of the pool's current round on up to num_threads threads,
+ * the calling one included. */
+static void mergeRound(struct merge_pool *pool, int count, int num_threads)
+{
+    int n = num_threads < count ? num_threads : count;
+    pthread_t *threads = calloc((size_t)n, sizeof(*threads));
+    int t, started = 0;
+    pool->count = count;
+    pool->next = 0;
+    for (t = 1; t < n; t++)
+    {
+        started += pthread_create(&threads[started], NULL, merge_worker_main, pool) == 0;
+    }
+    merge_worker_main(pool);
+    for (t = 0; t < started; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+}
+
+/**************************************************
+*Merges the partial tables in paths[] into table
+*with a tree reduction over num_threads threads.
+*Returns 0 on success, -1 if a partial could not be
+*loaded (table is left unchanged).
+**************************************************/
+int merge_partials(char *const paths[], int num_paths, int num_threads, struct climate_table *table)
+{
+    struct merge_pool pool;
+    int i, stride;
+    memset(&pool, 0, sizeof(pool));
+    pool.paths = paths;
+    pool.parts = calloc((size_t)num_paths, sizeof(*pool.parts));
+    for (i = 0; i < num_paths; i++)
+    {
+        init_table(&pool.parts[i]);
+    }
+    mergeRound(&pool, num_paths, num_threads);
+    if (pool.failed)
+    {
+        for (i = 0; i < num_paths; i++)
+        {
+            free_table(&pool.parts[i]);
+        }
+        free(pool.parts);
+        return -1;
+    }
+
+    STATS_ENTER(&table->stats, PHASE_MERGE, prev);
+    for (stride = 1; stride < num_paths; stride *= 2)
+    {
+        pool.stride = stride;
+        mergeRound(&pool, (num_paths + stride - 1) / (2 * stride), num_threads);
+    }
+    merge_states(table, &pool.parts[0]);
+    STATS_LEAVE(&table->stats, prev);
+    free_table(&pool.parts[0]);
+    free(pool.parts);
+    return 0;
+}
+
+/* --serve keeps the table in memory and answers report queries on a Unix
+ * socket. Files written into the watched directory are read by an ingest
+ * thread into a table of their own, which is merged into the served table
+ * under the lock; queries only hold the lock while formatting. A file that
+ * is appended to and closed again is read from where the last read
+ * stopped. Each query is answered on a thread of its own, so a slow client
+ * never holds up the directory watch; past SERVE_MAX_CLIENTS a connection
+ * is closed unanswered, which the querying side reports as a failure. */
+#define SERVE_EVENT_BUFFER 4096
+#define SERVE_REQUEST_MAX 64
+#define SERVE_SEND_TIMEOUT 5        //seconds a client may stall a report before it is dropped
+#define SERVE_MAX_CLIENTS 16        //queries answered at once; more are hung up on
+
+static const char *const formatNames[] = { "text", "csv", "json", "binary" };
+
+/* A watched-directory file waiting for the ingest thread. */
+struct serve_pending {
+    struct serve_pending *next;
+    char name[];
+};
+
+/* How much of a file has been read so far. */
+struct serve_file {
+    char *name;
+    off_t consumed;
+};
+
+struct server {
+    struct climate_table *table;
+    pthread_mutex_t lock;           //guards table
+    const char *dir;
+    pthread_t thread;
+    pthread_mutex_t queue_lock;     //guards the queue and stopping
+    pthread_cond_t queued;
+    struct serve_pending *head;
+    struct serve_pending *tail;
+    int stopping;
+    struct serve_file *files;       //only touched by the ingest thread
+    int num_files;
+    int files_capacity;
+    int clients;                    //queries being answered, guarded by queue_lock
+    pthread_cond_t idle;            //signalled when clients drops to 0
+};
+
+/* A connection handed to a query thread. */
+struct serve_client {
+    struct server *server;
+    int fd;
+};
+
+static volatile sig_atomic_t serveStopping;
+
+static void serveSignal(int sig)
+{
+    (void)sig;
+    serveStopping = 1;
+}
+
+/**************************************************
+*Returns 1 for names the server reads: not hidden,
+*not a temporary file and not a cache or zone map
+**************************************************/
+static int serveWanted(const char *name)
+{
+    size_t len = strlen(name);
+    size_t suffix = strlen(CACHE_SUFFIX);
+    size_t zone_suffix = strlen(ZONE_SUFFIX);
+    return name[0] != '.' && !(len >= 4 && strcmp(name + len - 4, ".tmp") == 0)
+        && !(len >= suffix && strcmp(name + len - suffix, CACHE_SUFFIX) == 0)
+        && !(len >= zone_suffix && strcmp(name + len - zone_suffix, ZONE_SUFFIX) == 0);
+}
+
+static void serveEnqueue(struct server *server, const char *name)
+{
+    struct serve_pending *pending = malloc(sizeof(*pending) + strlen(name) + 1);
+    strcpy(pending->name, name);
+    pending->next = NULL;
+    pthread_mutex_lock(&server->queue_lock);
+    if (server->tail != NULL)
+    {
+        server->tail->next = pending;
+    }
+    else
+    {
+        server->head = pending;
+    }
+    server->tail = pending;
+    pthread_cond_signal(&server->queued);
+    pthread_mutex_unlock(&server->queue_lock);
+}
+
+/**************************************************
+*Returns the read position record for a file name,
+*adding one at offset 0 if it is new
+**************************************************/
+static struct serve_file *serveFile(struct server *server, const char *name)
+{
+    int n;
+    for (n = 0; n < server->num_files; n++)
+    {
+        if (strcmp(server->files[n].name, name) == 0)
+        {
+            return &server->files[n];
+        }
+    }
+    if (server->num_files == server->files_capacity)
+    {
+        server->files_capacity = server->files_capacity > 0 ? 2 * server->files_capacity : 64;
+        server->files = realloc(server->files, (size_t)server->files_capacity * sizeof(*server->files));
+    }
+    struct serve_file *file = &server->files[server->num_files++];
+    file->name = strdup(name);
+    file->consumed = 0;
+    return file;
+}
+
+/**************************************************
+*Reads what is new in one watched file into a table
+*of its own and merges that into the served table.
+*Plain text is read up to its last newline, so a
+*line still being written is picked up next time;
+*compressed files and caches are read whole, once.
+**************************************************/
+static void serveIngest(struct server *server, const char *name)
+{
+    char *path = malloc(strlen(server->dir) + strlen(name) + 2);
+    if (path == NULL)
+    {
+        fprintf(stderr, "Could not read %s: out of memory\n", name);
+        return;
+    }
+    sprintf(path, "%s/%s", server->dir, name);
+    struct serve_file *file = serveFile(server, name);
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    int known = fd != -1 && fstat(fd, &st) == 0;
+    if (!known || !S_ISREG(st.st_mode) || st.st_size <= file->consumed)
+    {
+        if (known && S_ISREG(st.st_mode) && st.st_size < file->consumed)
+        {
+            fprintf(stderr, "%s shrank; only data written after this is read\n", path);
+            file->consumed = st.st_size;
+        }
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        free(path);
+        return;
+    }
+
+    size_t size = (size_t)st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map %s\n", path);
+        free(path);
+        return;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    struct climate_table part;
+    init_table(&part);
+    size_t start = (size_t)file->consumed;
+    if (start == 0 && (load_cache(data, size, &part) == 0 || analyze_compressed(data, size, 1, &part)))
+    {
+        file->consumed = st.st_size;
+    }
+    else
+    {
+        const char *last = memrchr(data + start, '\n', size - start);
+        if (last != NULL)
+        {
+            analyze_buffer(data + start, (size_t)(last + 1 - (data + start)), &part);
+            file->consumed = last + 1 - data;
+        }
+    }
+    munmap(data, size);
+
+    pthread_mutex_lock(&server->lock);
+    merge_states(server->table, &part);
+    pthread_mutex_unlock(&server->lock);
+    free_table(&part);
+    free(path);
+}
+
+static void *serve_ingest_main(void *arg)
+{
+    struct server *server = arg;
+    pthread_mutex_lock(&server->queue_lock);
+    while (!server->stopping)
+    {
+        struct serve_pending *pending = server->head;
+        if (pending == NULL)
+        {
+            pthread_cond_wait(&server->queued, &server->queue_lock);
+            continue;
+        }
+        server->head = pending->next;
+        if (server->head == NULL)
+        {
+            server->tail = NULL;
+        }
+        pthread_mutex_unlock(&server->queue_lock);
+        serveIngest(server, pending->name);
+        free(pending);
+        pthread_mutex_lock(&server->queue_lock);
+    }
+    pthread_mutex_unlock(&server->queue_lock);
+    return NULL;
+}
+
+/**************************************************
+*Answers one connection: reads the requested format
+*(a name from formatNames, or an empty line for the
+*server's --format), formats the report under the
+*lock and sends it after letting go of the lock
+**************************************************/
+static void serveQuery(struct server *server, int client)
+{
+    struct timeval timeout = { 1, 0 };      //a silent client gets the default format
+    struct timeval send_timeout = { SERVE_SEND_TIMEOUT, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+    char request[SERVE_REQUEST_MAX];
+    size_t len = 0;
+    ssize_t got;
+    while (len < sizeof(request) - 1 && (got = read(client, request + len, sizeof(request) - 1 - len)) > 0)
+    {
+        len += (size_t)got;
+        if (memchr(request, '\n', len) != NULL)
+        {
+            break;
+        }
+    }
+    request[len] = '\0';
+    request[strcspn(request, "\r\n")] = '\0';
+
+    enum report_format format = options.format;
+    size_t f;
+    for (f = 0; f < sizeof(formatNames) / sizeof(formatNames[0]); f++)
+    {
+        if (strcmp(request, formatNames[f]) == 0)
+        {
+            format = (enum report_format)f;
+        }
+    }
+
+    char *report = NULL;
+    size_t report_len = 0;
+    FILE *out = open_memstream(&report, &report_len);
+    if (out == NULL)
+    {
+        close(client);
+        return;
+    }
+    pthread_mutex_lock(&server->lock);
+    write_report(out, server->table, format);
+    pthread_mutex_unlock(&server->lock);
+    fclose(out);
+
+    size_t sent = 0;
+    ssize_t n;
+    while (sent < report_len && (n = write(client, report + sent, report_len - sent)) > 0)
+    {
+        sent += (size_t)n;
+    }
+    free(report);
+    close(client);
+}
+
+static void *serve_query_main(void *arg)
+{
+    struct serve_client *client = arg;
+    struct server *server = client->server;
+    serveQuery(server, client->fd);
+    free(client);
+    pthread_mutex_lock(&server->queue_lock);
+    if (--server->clients == 0)
+    {
+        pthread_cond_signal(&server->idle);
+    }
+    pthread_mutex_unlock(&server->queue_lock);
+    return NULL;
+}
+
+/**************************************************
+*Answers a connection on a detached thread, or on
+*the calling one if no thread can be started. The
+*connection is closed unanswered if SERVE_MAX_CLIENTS
+*queries are already running or memory runs out.
+**************************************************/
+static void serveAccept(struct server *server, int fd)
+{
+    struct serve_client *client = malloc(sizeof(*client));
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_mutex_lock(&server->queue_lock);
+    int admitted = client != NULL && server->clients < SERVE_MAX_CLIENTS;
+    if (admitted)
+    {
+        server->clients++;
+    }
+    pthread_mutex_unlock(&server->queue_lock);
+    if (!admitted)
+    {
+        free(client);
+        close(fd);
+        return;
+    }
+    client->server = server;
+    client->fd = fd;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, serve_query_main, client) != 0)
+    {
+        serve_query_main(client);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/**************************************************
+*Queues every file in the served directory. Files
+*read before are only read past their last end.
+**************************************************/
+static void serveScan(struct server *server)
+{
+    struct dirent **entries;
+    int num_entries = scandir(server->dir, &entries, NULL, alphasort);
+    int n;
+    for (n = 0; n < num_entries; n++)
+    {
+        if (serveWanted(entries[n]->d_name))
+        {
+            serveEnqueue(server, entries[n]->d_name);
+        }
+        free(entries[n]);
+    }
+    if (num_entries >= 0)
+    {
+        free(entries);
+    }
+}
+
+/**************************************************
+*Opens a listening Unix socket at path, replacing a
+*stale socket left by an earlier server. Returns the
+*socket, or -1 on error.
+**************************************************/
+static int serveListen(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0)
+    {
+        fprintf(stderr, "Could not listen on %s\n", path);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/**************************************************
+*Runs the server until SIGINT or SIGTERM: the files
+*already in dir are read first, then every file
+*closed after writing or moved into dir. Returns 0
+*after a clean shutdown, -1 if it could not start.
+**************************************************/
+int serve_table(const char *dir, const char *socket_path, struct climate_table *table)
+{
+    int watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch == -1 || inotify_add_watch(watch, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+    {
+        fprintf(stderr, "Could not watch %s\n", dir);
+        if (watch != -1)
+        {
+            close(watch);
+        }
+        return -1;
+    }
+    int listener = serveListen(socket_path);
+    if (listener == -1)
+    {
+        close(watch);
+        return -1;
+    }
+
+    struct server server;
+    memset(&server, 0, sizeof(server));
+    server.table = table;
+    server.dir = dir;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_mutex_init(&server.queue_lock, NULL);
+    pthread_cond_init(&server.queued, NULL);
+    pthread_cond_init(&server.idle, NULL);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serveSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);       //clients may hang up mid-report
+
+    //the watch is in place first, so a file cannot slip in between
+    serveScan(&server);
+    int n;
+    if (pthread_create(&server.thread, NULL, serve_ingest_main, &server) != 0)
+    {
+        fprintf(stderr, "Could not start the ingest thread\n");
+        close(listener);
+        close(watch);
+        unlink(socket_path);
+        return -1;
+    }
+    fprintf(stderr, "Serving %s on %s\n", dir, socket_path);
+
+    char events[SERVE_EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!serveStopping)
+    {
+        struct pollfd fds[2] = { { watch, POLLIN, 0 }, { listener, POLLIN, 0 } };
+        if (poll(fds, 2, -1) == -1)
+        {
+            continue;       //EINTR: check for a stop signal
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            ssize_t len;
+            int overflowed = 0;
+            while ((len = read(watch, events, sizeof(events))) > 0)
+            {
+                char *p;
+                for (p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+                {
+                    const struct inotify_event *event = (const struct inotify_event *)p;
+                    overflowed |= (event->mask & IN_Q_OVERFLOW) != 0;
+                    if (event->len > 0 && !(event->mask & IN_ISDIR) && serveWanted(event->name))
+                    {
+                        serveEnqueue(&server, event->name);
+                    }
+                }
+            }
+            //events were lost, so look at every file again
+            if (overflowed)
+            {
+                fprintf(stderr, "Watch queue overflowed; rescanning %s\n", dir);
+                serveScan(&server);
+            }
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            if (client != -1)
+            {
+                serveAccept(&server, client);
+            }
+        }
+    }
+
+    //a file being read is finished; the rest of the queue is dropped
+    pthread_mutex_lock(&server.queue_lock);
+    server.stopping = 1;
+    pthread_cond_signal(&server.queued);
+    pthread_mutex_unlock(&server.queue_lock);
+    pthread_join(server.thread, NULL);
+    //queries in flight finish within their socket timeouts
+    pthread_mutex_lock(&server.queue_lock);
+    while (server.clients > 0)
+    {
+        pthread_cond_wait(&server.idle, &server.queue_lock);
+    }
+    pthread_mutex_unlock(&server.queue_lock);
+    while (server.head != NULL)
+    {
+        struct serve_pending *next = server.head->next;
+        free(server.head);
+        server.head = next;
+    }
+    for (n = 0; n < server.num_files; n++)
+    {
+        free(server.files[n].name);
+    }
+    free(server.files);
+    close(listener);
+    close(watch);
+    unlink(socket_path);
+    pthread_mutex_destroy(&server.lock);
+    pthread_mutex_destroy(&server.queue_lock);
+    pthread_cond_destroy(&server.queued);
+    pthread_cond_destroy(&server.idle);
+    fprintf(stderr, "Server stopped\n");
+    return 0;
+}
+
+/**************************************************
+*Asks the server on socket_path for a report in the
+*given format and copies it to stdout. Returns 0 on
+*success, -1 if the server could not be reached or
+*hung up without a report (it was busy).
+**************************************************/
+int query_server(const char *socket_path, enum report_format format)
+{
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    char request[SERVE_REQUEST_MAX];
+    int len = snprintf(request, sizeof(request), "%s\n", formatNames[format]);
+    //a busy server may already have hung up, which must not raise SIGPIPE
+    if (send(fd, request, (size_t)len, MSG_NOSIGNAL) != len)
+    {
+        close(fd);
+        return -1;
+    }
+    shutdown(fd, SHUT_WR);
+    char buffer[65536];
+    ssize_t got;
+    size_t total = 0;
+    while ((got = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        fwrite(buffer, 1, (size_t)got, stdout);
+        total += (size_t)got;
+    }
+    close(fd);
+    return got == 0 && total > 0 ? 0 : -1;
+}
+
+/* Reports are formatted into one large buffer by a report_writer and
+ * written out whenever it fills, so per-cell and per-bucket output does
+ * not go through stdio a field at a time. */
+#define REPORT_BUFFER_SIZE (1 << 20)
+
+/* --format=binary writes a report_header followed, for each state, by a
+ * report_state with its num_cells report_cells and num_buckets
+ * report_buckets. Temperatures are in Fahrenheit and times in UNIX
+ * seconds, as in the other formats; values not computed are NaN. */
+#define REPORT_MAGIC "CLIMREPT"
+#define REPORT_VERSION 1
+
+struct report_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_states;
+    uint32_t geohash_precision;     //0 when no cells follow
+    uint32_t rollup_unit;           //enum rollup_unit
+};
+
+struct report_state {
+    char code[4];
+    uint32_t num_records;
+    int32_t lightning;
+    int32_t snow;
+    double avg_humidity;
+    double avg_temperature;
+    double max_temperature;
+    double min_temperature;
+    double avg_cloud;
+    int64_t max_time;
+    int64_t min_time;
+    double temperature_percentiles[3];  //p50, p95, p99
+    double humidity_percentiles[3];
+    uint32_t num_cells;
+    uint32_t num_buckets;
+};
+
+struct report_cell {
+    char geohash[GEOHASH_MAX_PRECISION + 2];
+    uint32_t num_records;
+    int32_t lightning;
+    uint32_t reserved;
+    double avg_temperature;
+    double min_temperature;
+    double max_temperature;
+    double avg_humidity;
+};
+
+struct report_bucket {
+    int64_t start;                  //UTC
+    uint32_t num_records;
+    int32_t lightning;
+    double avg_temperature;
+    double min_temperature;
+    double max_temperature;
+    double avg_humidity;
+};
+
+struct report_writer {
+    FILE *out;
+    char *buffer;
+    size_t used;
+};
+
+static void writerFlush(struct report_writer *w)
+{
+    fwrite(w->buffer, 1, w->used, w->out);
+    w->used = 0;
+}
+
+/* Returns room for at least n bytes at the end of the buffer. */
+static char *writerReserve(struct report_writer *w, size_t n)
+{
+    if (REPORT_BUFFER_SIZE - w->used < n)
+    {
+        writerFlush(w);
+    }
+    return w->buffer + w->used;
+}
+
+static void writerBytes(struct report_writer *w, const void *data, size_t n)
+{
+    if (n > REPORT_BUFFER_SIZE)
+    {
+        writerFlush(w);
+        fwrite(data, 1, n, w->out);
+        return;
+    }
+    memcpy(writerReserve(w, n), data, n);
+    w->used += n;
+}
+
+static void writerString(struct report_writer *w, const char *s)
+{
+    writerBytes(w, s, strlen(s));
+}
+
+static void writerChar(struct report_writer *w, char c)
+{
+    *writerReserve(w, 1) = c;
+    w->used++;
+}
+
+static void writerUnsigned(struct report_writer *w, unsigned long long n)
+{
+    char digits[20];
+    int len = 0;
+    do
+    {
+        digits[len++] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n != 0);
+    char *p = writerReserve(w, (size_t)len);
+    w->used += (size_t)len;
+    while (len > 0)
+    {
+        *p++ = digits[--len];
+    }
+}
+
+static void writerInt(struct report_writer *w, long long n)
+{
+    if (n < 0)
+    {
+        writerChar(w, '-');
+        writerUnsigned(w, 0ULL - (unsigned long long)n);
+        return;
+    }
+    writerUnsigned(w, (unsigned long long)n);
+}
+
+/**************************************************
+*Writes x with the given number of decimals (at most
+*6), exactly as printf's %.Nf would. Values are
+*rounded from x * 10^digits; when that is too close to
+*a rounding tie to be sure, or too large to be exact,
+*printf formats it instead.
+**************************************************/
+static void writerFixed(struct report_writer *w, double x, int digits)
+{
+    double scaled = fabs(x) * exactPow10[digits];
+    double whole = floor(scaled);
+    if (!(scaled < 1e9) || fabs(scaled - whole - 0.5) < 1e-6)
+    {
+        char text[512];
+        int len = snprintf(text, sizeof(text), "%.*f", digits, x);
+        writerBytes(w, text, (size_t)len);
+        return;
+    }
+    unsigned long long n = (unsigned long long)whole + (scaled - whole > 0.5);
+    unsigned long long unit = (unsigned long long)exactPow10[digits];
+    if (signbit(x))
+    {
+        writerChar(w, '-');
+    }
+    writerUnsigned(w, n / unit);
+    if (digits > 0)
+    {
+        char *p = writerReserve(w, (size_t)digits + 1);
+        int i;
+        *p = '.';
+        for (i = digits; i > 0; i--, n /= 10)
+        {
+            p[i] = (char)('0' + n % 10);
+        }
+        w->used += (size_t)digits + 1;
+    }
+}
+
+/* Like writerFixed, but NaN (a value that was not computed) is written as
+ * the given placeholder. */
+static void writerNumber(struct report_writer *w, double x, int digits, const char *missing)
+{
+    if (x != x)
+    {
+        writerString(w, missing);
+        return;
+    }
+    writerFixed(w, x, digits);
+}
+
+/* localtime_r() results for recently formatted hours; observations are
+ * hourly, so most timestamps in a report hit. */
+#define TIME_CACHE_SLOTS 64
+
+static struct {
+    long long hour[TIME_CACHE_SLOTS];
+    struct tm tm[TIME_CACHE_SLOTS];
+    int valid[TIME_CACHE_SLOTS];
+} timeCache;
+
+/**************************************************
+*Writes t in local time the way ctime() does
+*("Mon Aug  3 11:00:00 2015\n"). The local time of the
+*hour is cached; zones whose offset is not a whole
+*number of hours are converted every time.
+**************************************************/
+static void writerCtime(struct report_writer *w, time_t t)
+{
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    long long hour = (long long)t >= 0 ? (long long)t / 3600 : ((long long)t - 3599) / 3600;
+    int slot = (int)(hour & (TIME_CACHE_SLOTS - 1));
+    int offset = (int)(t - hour * 3600);
+    struct tm tm;
+    if (!timeCache.valid[slot] || timeCache.hour[slot] != hour)
+    {
+        time_t start = (time_t)(hour * 3600);
+        if (localtime_r(&start, &tm) == NULL)
+        {
+            writerString(w, "(null)");      //what printf("%s", ctime()) shows
+            return;
+        }
+        timeCache.hour[slot] = hour;
+        timeCache.tm[slot] = tm;
+        timeCache.valid[slot] = tm.tm_min == 0 && tm.tm_sec == 0;
+        if (!timeCache.valid[slot])
+        {
+            localtime_r(&t, &tm);
+        }
+    }
+    if (timeCache.valid[slot])
+    {
+        tm = timeCache.tm[slot];
+        tm.tm_min = offset / 60;
+        tm.tm_sec = offset % 60;
+    }
+
+    char *p = writerReserve(w, 20);
+    memcpy(p, days + 3 * tm.tm_wday, 3);
+    p[3] = ' ';
+    memcpy(p + 4, months + 3 * tm.tm_mon, 3);
+    p[7] = ' ';
+    p[8] = tm.tm_mday >= 10 ? (char)('0' + tm.tm_mday / 10) : ' ';
+    p[9] = (char)('0' + tm.tm_mday % 10);
+    p[10] = ' ';
+    p[11] = (char)('0' + tm.tm_hour / 10);
+    p[12] = (char)('0' + tm.tm_hour % 10);
+    p[13] = ':';
+    p[14] = (char)('0' + tm.tm_min / 10);
+    p[15] = (char)('0' + tm.tm_min % 10);
+    p[16] = ':';
+    p[17] = (char)('0' + tm.tm_sec / 10);
+    p[18] = (char)('0' + tm.tm_sec % 10);
+    p[19] = ' ';
+    w->used += 20;
+    writerInt(w, tm.tm_year + 1900LL);
+    writerChar(w, '\n');
+}
+
+/**************************************************
+*Writes t as an ISO 8601 UTC time
+*("2015-08-03T11:00:00Z")
+**************************************************/
+static void writerIsoTime(struct report_writer *w, long long t)
+{
+    long long days = t >= 0 ? t / 86400 : (t - 86399) / 86400;
+    int seconds = (int)(t - days * 86400);
+    int year, month, day;
+    char text[48];
+    civilFromDays(days, &year, &month, &day);
+    int len = snprintf(text, sizeof(text), "%04d-%02d-%02dT%02d:%02d:%02dZ", year, month, day,
+                       seconds / 3600, seconds / 60 % 60, seconds % 60);
+    writerBytes(w, text, (size_t)len);
+}
+
+static double fahrenheit(double kelvin)
+{
+    return kelvin * 1.8 - 459.67;
+}
+
+static int compareCellKeys(const void *a, const void *b)
+{
+    uint64_t x = (*(const struct geo_cell *const *)a)->key;
+    uint64_t y = (*(const struct geo_cell *const *)b)->key;
+    return x < y ? -1 : x > y;
+}
+
+/**************************************************
+*Returns the geohash cells of one state in geohash
+*order (a malloc'd array) and stores their count
+**************************************************/
+static const struct geo_cell **stateCells(const struct climate_table *table, int stateSlot, unsigned int *count)
+{
+    const struct geo_table *geo = &table->geo;
+    const struct geo_cell **cells = malloc((geo->num_cells + 1) * sizeof(*cells));
+    unsigned int n;
+    *count = 0;
+    for (n = 0; n < geo->num_cells; n++)
+    {
+        const struct geo_cell *cell = geoCellAt(geo, n);
+        if ((int)(cell->key >> 54) == stateSlot + 1)
+        {
+            cells[(*count)++] = cell;
+        }
+    }
+    qsort(cells, *count, sizeof(*cells), compareCellKeys);
+    return cells;
+}
+
+static void cellName(const struct geo_cell *cell, char name[GEOHASH_MAX_PRECISION + 1])
+{
+    int precision = options.geohash_precision;
+    int c;
+    for (c = 0; c < precision; c++)
+    {
+        name[c] = geohashAlphabet[(cell->key >> (5 * (precision - 1 - c))) & 31];
+    }
+    name[precision] = '\0';
+}
+
+static void geohashText(uint64_t packed, char name[13])
+{
+    int len = (int)(packed >> 60);
+    int c;
+    for (c = 0; c < len; c++)
+    {
+        name[c] = geohashAlphabet[(packed >> (5 * (len - 1 - c))) & 31];
+    }
+    name[len] = '\0';
+}
+
+static int compareEvents(const void *a, const void *b)
+{
+    const struct extreme_event *x = a, *y = b;
+    return eventAbove(x, y) ? -1 : eventAbove(y, x) ? 1 : 0;
+}
+
+/**************************************************
+*Copies a top-K heap into events, best first, and
+*returns the number of events
+**************************************************/
+static int sortedEvents(const struct top_events *top, struct extreme_event events[TOP_MAX])
+{
+    memcpy(events, top->heap, top->count * sizeof(*events));
+    qsort(events, top->count, sizeof(*events), compareEvents);
+    return top->count;
+}
+
+static int compareCellLightning(const void *a, const void *b)
+{
+    const struct geo_cell *x = *(const struct geo_cell *const *)a, *y = *(const struct geo_cell *const *)b;
+    if (x->lightning != y->lightning)
+    {
+        return x->lightning > y->lightning ? -1 : 1;
+    }
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/**************************************************
+*Returns the --top K cells of a state with the most
+*lightning, most first, and sets count. Cell totals
+*are only final once every worker is merged, so the
+*cells are ranked here rather than while reading.
+*Cells without lightning are left out. Caller frees.
+**************************************************/
+static const struct geo_cell **lightningCells(const struct climate_table *table, int stateSlot, unsigned int *count)
+{
+    const struct geo_cell **cells = stateCells(table, stateSlot, count);
+    unsigned int n, kept = 0;
+    qsort(cells, *count, sizeof(*cells), compareCellLightning);
+    for (n = 0; n < *count && kept < (unsigned int)options.top && cells[n]->lightning > 0; n++)
+    {
+        kept++;
+    }
+    *count = kept;
+    return cells;
+}
+
+static long long usedBuckets(const struct time_series *series)
+{
+    long long b, used = 0;
+    for (b = 0; b < series->length; b++)
+    {
+        used += series->buckets[b].num_records != 0;
+    }
+    return used;
+}
+
+/**************************************************
+*Labels bucket number with its start time in UTC and
+*returns that time in UNIX seconds
+**************************************************/
+static long long bucketLabel(long long number, char *label, size_t size)
+{
+    int year, month, day;
+    switch (options.rollup)
+    {
+    case ROLLUP_HOUR:
+        civilFromDays(number >= 0 ? number / 24 : (number - 23) / 24, &year, &month, &day);
+        snprintf(label, size, "%04d-%02d-%02d %02d:00", year, month, day, (int)(((number % 24) + 24) % 24));
+        return number * 3600;
+    case ROLLUP_DAY:
+        civilFromDays(number, &year, &month, &day);
+        snprintf(label, size, "%04d-%02d-%02d", year, month, day);
+        return number * 86400;
+    default:
+        year = (int)(number >= 0 ? number / 12 : (number - 11) / 12);
+        month = (int)(number - (long long)year * 12) + 1;
+        snprintf(label, size, "%04d-%02d", year, month);
+        return daysFromCivil(year, month, 1) * 86400;
+    }
+}
+
+/* The line shared by geohash cells and rollup buckets in the text report. */
+static void writeTextGroup(struct report_writer *w, const char *name, unsigned int num_records, double temperature,
+                           double minTemp, double maxTemp, double humidity, int lightning)
+{
+    writerString(w, "  ");
+    writerString(w, name);
+    writerString(w, ": ");
+    writerUnsigned(w, num_records);
+    writerString(w, " records, avg ");
+    writerFixed(w, fahrenheit(temperature / num_records), 1);
+    writerString(w, "F, min ");
+    writerFixed(w, fahrenheit(minTemp), 1);
+    writerString(w, "F, max ");
+    writerFixed(w, fahrenheit(maxTemp), 1);
+    writerString(w, "F, humidity ");
+    writerFixed(w, humidity / num_records, 1);
+    writerString(w, "%, lightning ");
+    writerInt(w, lightning);
+    writerChar(w, '\n');
+}
+
+static void writeTextEvents(struct report_writer *w, const char *title, const struct top_events *top, int sign)
+{
+    struct extreme_event events[TOP_MAX];
+    int n = sortedEvents(top, events), e;
+    writerString(w, title);
+    writerInt(w, n);
+    writerChar(w, '\n');
+    for (e = 0; e < n; e++)
+    {
+        char name[13];
+        geohashText(events[e].geohash, name);
+        writerString(w, "  ");
+        writerFixed(w, fahrenheit(sign * events[e].key), 1);
+        writerString(w, "F at ");
+        writerString(w, name[0] != '\0' ? name : "-");
+        writerString(w, " on ");
+        writerCtime(w, (time_t)(events[e].timestamp / 1000));
+    }
+}
+
+static void reportText(struct report_writer *w, const struct climate_table *table)
+{
+    static const char *const unitNames[] = { "", "hour", "day", "month" };
+    const struct climate_info *states = table->states;
+    int num_states = countStates(table);
+    int i, e;
+    writerString(w, "States found: ");
+    for (i = 0; i < num_states; ++i)
+    {
+        writerString(w, states[i].code);
+        writerChar(w, ' ');
+    }
+    writerChar(w, '\n');
+
+    for (i = 0; i < num_states; i++)
+    {
+        const struct climate_info *info = &states[i];
+        writerString(w, "-- State: ");
+        writerString(w, info->code);
+        writerString(w, " --\nNumber of Records: ");
+        writerInt(w, (int)info->num_records);
+        writerString(w, "\nAverage Humidity: ");
+        writerFixed(w, (info->avgHumidity + info->humidityError) / info->num_records, 1);
+        writerString(w, "%\nAverage Temperature: ");
+        writerFixed(w, fahrenheit((info->temperature + info->temperatureError) / info->num_records), 1);
+        writerString(w, "F\nMax Temperature: ");
+        writerFixed(w, fahrenheit(info->maxTemp), 1);
+        writerString(w, "F\nMax Temperature on: ");
+        writerCtime(w, (time_t)(info->maxTempTimestamp / 1000));
+        writerString(w, "Min Temperature: ");
+        writerFixed(w, fahrenheit(info->minTemp), 1);
+        writerString(w, "F\nMin Temperature on: ");
+        writerCtime(w, (time_t)(info->minTempTimestamp / 1000));
+        writerString(w, "Lightning Strikes: ");
+        writerInt(w, info->lightning);
+        writerString(w, "\nRecords with Snow Cover: ");
+        writerInt(w, info->snow);
+        writerString(w, "\nAverage Cloud Cover: ");
+        writerFixed(w, (info->cloud + info->cloudError) / info->num_records, 1);
+        writerString(w, "% \n");
+        for (e = 0; e < TDV_NUM_EXTRAS; e++)
+        {
+            writerString(w, "Average ");
+            writerString(w, extraColumns[e].label);
+            writerString(w, ": ");
+            writerFixed(w, (info->extra[e] + info->extraError[e]) / info->num_records, 1);
+            writerChar(w, '\n');
+        }
+
+        if (options.percentiles)
+        {
+            const struct state_digests *digests = &table->digests[i];
+            writerString(w, "Temperature Percentiles: p50 ");
+            writerNumber(w, fahrenheit(digestQuantile(&digests->temperature, 0.50)), 1, "nan");
+            writerString(w, "F, p95 ");
+            writerNumber(w, fahrenheit(digestQuantile(&digests->temperature, 0.95)), 1, "nan");
+            writerString(w, "F, p99 ");
+            writerNumber(w, fahrenheit(digestQuantile(&digests->temperature, 0.99)), 1, "nan");
+            writerString(w, "F\nHumidity Percentiles: p50 ");
+            writerNumber(w, digestQuantile(&digests->humidity, 0.50), 1, "nan");
+            writerString(w, "%, p95 ");
+            writerNumber(w, digestQuantile(&digests->humidity, 0.95), 1, "nan");
+            writerString(w, "%, p99 ");
+            writerNumber(w, digestQuantile(&digests->humidity, 0.99), 1, "nan");
+            writerString(w, "%\n");
+        }
+
+        if (options.top > 0)
+        {
+            writeTextEvents(w, "Hottest Readings: ", &table->extremes[i].hottest, 1);
+            writeTextEvents(w, "Coldest Readings: ", &table->extremes[i].coldest, -1);
+        }
 
-    
-    while (fgets(line, line_sz, file) != NULL)
-    {
-        /* TODO: We need to do a few things here:
-         *
-         *       * Tokenize the line.
-         *       * Determine what state the line is for. This will be the state
-         *         code, stored as our first token.
-         *       * If our states array doesn't have a climate_info entry for
-         *         this state, then we need to allocate memory for it and put it
-         *         in the next open place in the array. Otherwise, we reuse the
-         *         existing entry.
-         *       * Update the climate_info structure as necessary.
-         */
-        
-        char *foundCode = strtok(line, "\t\n");// tokenizes the first token to state code
-        int stateNumOrder = compareOrder(states, foundCode, currentStates);
-        if (stateNumOrder == -1)// if the state is the first of its kind in the struct
-        {
-            if (currentStates >= num_states)
-            {
-                fprintf(stderr, "Error: too many states (There are already %d states, should not add more)\n",currentStates);
-                exit(EXIT_FAILURE);
-            }
-            states[currentStates] = (struct climate_info *)calloc(sizeof(struct climate_info), 1);
-            strcpy((states[currentStates])->code, foundCode);
-            states[currentStates]->minTemp = -9999;
-            states[currentStates]->maxTemp = 9999;
-            stateNumOrder = currentStates++;
-        }
-        
-       
-        states[stateNumOrder]->num_records += 1;
-        //Time Stamp
-        char* currentTimeStamp = strtok(NULL, "\t\n");
-        
-        //skip GeoLocation
-        char* currentGeol = strtok(NULL, "\t\n");
-        states[stateNumOrder]->geoLocation += *currentGeol;
-        //Average Humidity
-        char* currentHumidity = strtok(NULL, "\t\n");
-        states[stateNumOrder]->avgHumidity += atof(currentHumidity);
-        //Snow Cover
-        char* currentSnow = strtok(NULL, "\t\n");
-        states[stateNumOrder]->snow += atoi(currentSnow);
-        //Cloud Cover
-        char* currentCloud = strtok(NULL, "\t\n");
-        states[stateNumOrder]->cloud += atof(currentCloud);
-        //Lightning Strikes
-        char* currentLightning = strtok(NULL, "\t\n");
-        states[stateNumOrder]->lightning += atoi(currentLightning);
-        //skip Pressure
-        char* currentPressure = strtok(NULL, "\t\n");
-        states[stateNumOrder]->pressure += atof(currentPressure);
-        //Temperature
-        double temp = atof(strtok(NULL, "\t\n"));
-        states[stateNumOrder]->temperature += temp;
-        
-        //Checking if the temperature is the minimum or maximum temp for that State
-        if(temp < states[stateNumOrder]->minTemp)
-        {
-            states[stateNumOrder]->minTemp = temp;
-            states[stateNumOrder]->minTempTimestamp = atoll(currentTimeStamp);
-        }
-        else if(temp > states[stateNumOrder]->maxTemp)
-        {
-            states[stateNumOrder]->maxTemp = temp;
-            states[stateNumOrder]->maxTempTimestamp = atoll(currentTimeStamp);
-        }
-    }
-}
-
-void print_report(struct climate_info *states[], int num_states)
-{
-    printf("States found: ");
-    int i;
+        if (options.geohash_precision > 0)
+        {
+            unsigned int count, n;
+            const struct geo_cell **cells = stateCells(table, stateKey(info->code), &count);
+            writerString(w, "Geohash Cells (precision ");
+            writerInt(w, options.geohash_precision);
+            writerString(w, "): ");
+            writerUnsigned(w, count);
+            writerChar(w, '\n');
+            for (n = 0; n < count; n++)
+            {
+                char name[GEOHASH_MAX_PRECISION + 1];
+                cellName(cells[n], name);
+                writeTextGroup(w, name, cells[n]->num_records, cells[n]->temperature, cells[n]->minTemp,
+                               cells[n]->maxTemp, cells[n]->humidity, cells[n]->lightning);
+            }
+            free(cells);
+        }
+
+        if (options.geohash_precision > 0 && options.top > 0)
+        {
+            unsigned int count, n;
+            const struct geo_cell **cells = lightningCells(table, stateKey(info->code), &count);
+            writerString(w, "Most Lightning Cells: ");
+            writerUnsigned(w, count);
+            writerChar(w, '\n');
+            for (n = 0; n < count; n++)
+            {
+                char name[GEOHASH_MAX_PRECISION + 1];
+                cellName(cells[n], name);
+                writeTextGroup(w, name, cells[n]->num_records, cells[n]->temperature, cells[n]->minTemp,
+                               cells[n]->maxTemp, cells[n]->humidity, cells[n]->lightning);
+            }
+            free(cells);
+        }
+
+        if (options.rollup != ROLLUP_NONE)
+        {
+            const struct time_series *series = &table->rollups[i];
+            long long b;
+            writerString(w, "Rollup by ");
+            writerString(w, unitNames[options.rollup]);
+            writerString(w, " (UTC): ");
+            writerInt(w, usedBuckets(series));
+            writerString(w, " buckets\n");
+            for (b = 0; b < series->length; b++)
+            {
+                const struct time_bucket *bucket = &series->buckets[b];
+                char label[32];
+                if (bucket->num_records == 0)
+                {
+                    continue;
+                }
+                bucketLabel(series->first + b, label, sizeof(label));
+                writeTextGroup(w, label, bucket->num_records, bucket->temperature, bucket->minTemp,
+                               bucket->maxTemp, bucket->humidity, bucket->lightning);
+            }
+        }
+    }
+}
+
+/* One CSV row per state, geohash cell, rollup bucket and extreme event.
+ * kind says which; key is the cell's or event's geohash or the bucket's
+ * start. Columns that do not apply to a kind are left empty. */
+static void writeCsvGroup(struct report_writer *w, const char *kind, const char *code, const char *key,
+                          unsigned int num_records, double temperature, double minTemp, double maxTemp,
+                          double humidity, int lightning)
+{
+    writerString(w, kind);
+    writerChar(w, ',');
+    writerString(w, code);
+    writerChar(w, ',');
+    writerString(w, key);
+    writerChar(w, ',');
+    writerUnsigned(w, num_records);
+    writerChar(w, ',');
+    writerFixed(w, humidity / num_records, 3);
+    writerChar(w, ',');
+    writerFixed(w, fahrenheit(temperature / num_records), 3);
+    writerChar(w, ',');
+    writerFixed(w, fahrenheit(minTemp), 3);
+    writerString(w, ",,");
+    writerFixed(w, fahrenheit(maxTemp), 3);
+    writerString(w, ",,");
+    writerInt(w, lightning);
+    writerString(w, options.percentiles ? ",,,,,,,," : ",,");
+    int e;
+    for (e = 0; e < TDV_NUM_EXTRAS; e++)
+    {
+        writerChar(w, ',');
+    }
+    writerChar(w, '\n');
+}
+
+/* Hottest events fill the max_temperature columns, coldest the min ones. */
+static void writeCsvEvents(struct report_writer *w, const char *kind, const char *code, const struct top_events *top,
+                           int sign)
+{
+    struct extreme_event events[TOP_MAX];
+    int n = sortedEvents(top, events), e, x;
+    for (e = 0; e < n; e++)
+    {
+        char name[13];
+        geohashText(events[e].geohash, name);
+        writerString(w, kind);
+        writerChar(w, ',');
+        writerString(w, code);
+        writerChar(w, ',');
+        writerString(w, name);
+        writerString(w, ",1,,");
+        writerFixed(w, fahrenheit(sign * events[e].key), 3);
+        writerString(w, sign > 0 ? ",,," : ",");
+        writerFixed(w, fahrenheit(sign * events[e].key), 3);
+        writerChar(w, ',');
+        writerIsoTime(w, (long long)(events[e].timestamp / 1000));
+        writerString(w, sign > 0 ? ",,," : ",,,,,");
+        writerString(w, options.percentiles ? ",,,,,," : "");
+        for (x = 0; x < TDV_NUM_EXTRAS; x++)
+        {
+            writerChar(w, ',');
+        }
+        writerChar(w, '\n');
+    }
+}
+
+static void reportCsv(struct report_writer *w, const struct climate_table *table)
+{
+    static const double quantiles[3] = { 0.50, 0.95, 0.99 };
+    int num_states = countStates(table);
+    int i, q, e;
+    writerString(w, "kind,state,key,records,avg_humidity,avg_temperature_f,min_temperature_f,min_temperature_time,"
+                 "max_temperature_f,max_temperature_time,lightning,snow,avg_cloud");
+    writerString(w, options.percentiles ? ",temperature_p50_f,temperature_p95_f,temperature_p99_f,"
+                 "humidity_p50,humidity_p95,humidity_p99" : "");
+    for (e = 0; e < TDV_NUM_EXTRAS; e++)
+    {
+        writerString(w, ",avg_");
+        writerString(w, extraColumns[e].name);
+    }
+    writerChar(w, '\n');
+
+    for (i = 0; i < num_states; i++)
+    {
+        const struct climate_info *info = &table->states[i];
+        writerString(w, "state,");
+        writerString(w, info->code);
+        writerString(w, ",,");
+        writerUnsigned(w, info->num_records);
+        writerChar(w, ',');
+        writerFixed(w, (info->avgHumidity + info->humidityError) / info->num_records, 3);
+        writerChar(w, ',');
+        writerFixed(w, fahrenheit((info->temperature + info->temperatureError) / info->num_records), 3);
+        writerChar(w, ',');
+        writerFixed(w, fahrenheit(info->minTemp), 3);
+        writerChar(w, ',');
+        writerIsoTime(w, (long long)(info->minTempTimestamp / 1000));
+        writerChar(w, ',');
+        writerFixed(w, fahrenheit(info->maxTemp), 3);
+        writerChar(w, ',');
+        writerIsoTime(w, (long long)(info->maxTempTimestamp / 1000));
+        writerChar(w, ',');
+        writerInt(w, info->lightning);
+        writerChar(w, ',');
+        writerInt(w, info->snow);
+        writerChar(w, ',');
+        writerFixed(w, (info->cloud + info->cloudError) / info->num_records, 3);
+        if (options.percentiles)
+        {
+            for (q = 0; q < 3; q++)
+            {
+                writerChar(w, ',');
+                writerNumber(w, fahrenheit(digestQuantile(&table->digests[i].temperature, quantiles[q])), 3, "");
+            }
+            for (q = 0; q < 3; q++)
+            {
+                writerChar(w, ',');
+                writerNumber(w, digestQuantile(&table->digests[i].humidity, quantiles[q]), 3, "");
+            }
+        }
+        for (e = 0; e < TDV_NUM_EXTRAS; e++)
+        {
+            writerChar(w, ',');
+            writerFixed(w, (info->extra[e] + info->extraError[e]) / info->num_records, 3);
+        }
+        writerChar(w, '\n');
+
+        if (options.geohash_precision > 0)
+        {
+            unsigned int count, n;
+            const struct geo_cell **cells = stateCells(table, stateKey(info->code), &count);
+            for (n = 0; n < count; n++)
+            {
+                char name[GEOHASH_MAX_PRECISION + 1];
+                cellName(cells[n], name);
+                writeCsvGroup(w, "cell", info->code, name, cells[n]->num_records, cells[n]->temperature,
+                              cells[n]->minTemp, cells[n]->maxTemp, cells[n]->humidity, cells[n]->lightning);
+            }
+            free(cells);
+        }
+
+        if (options.top > 0)
+        {
+            writeCsvEvents(w, "hottest", info->code, &table->extremes[i].hottest, 1);
+            writeCsvEvents(w, "coldest", info->code, &table->extremes[i].coldest, -1);
+        }
+
+        if (options.geohash_precision > 0 && options.top > 0)
+        {
+            unsigned int count, n;
+            const struct geo_cell **cells = lightningCells(table, stateKey(info->code), &count);
+            for (n = 0; n < count; n++)
+            {
+                char name[GEOHASH_MAX_PRECISION + 1];
+                cellName(cells[n], name);
+                writeCsvGroup(w, "top_lightning", info->code, name, cells[n]->num_records, cells[n]->temperature,
+                              cells[n]->minTemp, cells[n]->maxTemp, cells[n]->humidity, cells[n]->lightning);
+            }
+            free(cells);
+        }
+
+        if (options.rollup != ROLLUP_NONE)
+        {
+            const struct time_series *series = &table->rollups[i];
+            long long b;
+            for (b = 0; b < series->length; b++)
+            {
+                const struct time_bucket *bucket = &series->buckets[b];
+                char label[32];
+                if (bucket->num_records != 0)
+                {
+                    bucketLabel(series->first + b, label, sizeof(label));
+                    writeCsvGroup(w, "bucket", info->code, label, bucket->num_records, bucket->temperature,
+                                  bucket->minTemp, bucket->maxTemp, bucket->humidity, bucket->lightning);
+                }
+            }
+        }
+    }
+}
+
+/* The members shared by geohash cells and rollup buckets in JSON. */
+static void writeJsonGroup(struct report_writer *w, unsigned int num_records, double temperature,
+                           double minTemp, double maxTemp, double humidity, int lightning)
+{
+    writerString(w, ", \"records\": ");
+    writerUnsigned(w, num_records);
+    writerString(w, ", \"avg_temperature_f\": ");
+    writerFixed(w, fahrenheit(temperature / num_records), 3);
+    writerString(w, ", \"min_temperature_f\": ");
+    writerFixed(w, fahrenheit(minTemp), 3);
+    writerString(w, ", \"max_temperature_f\": ");
+    writerFixed(w, fahrenheit(maxTemp), 3);
+    writerString(w, ", \"avg_humidity\": ");
+    writerFixed(w, humidity / num_records, 3);
+    writerString(w, ", \"lightning\": ");
+    writerInt(w, lightning);
+    writerChar(w, '}');
+}
+
+static void writeJsonPercentiles(struct report_writer *w, const char *name, const struct digest *d, int fahrenheitScale)
+{
+    static const double quantiles[3] = { 0.50, 0.95, 0.99 };
+    static const char *const names[3] = { "\"p50\": ", ", \"p95\": ", ", \"p99\": " };
+    int q;
+    writerString(w, name);
+    writerChar(w, '{');
+    for (q = 0; q < 3; q++)
+    {
+        double value = digestQuantile(d, quantiles[q]);
+        writerString(w, names[q]);
+        writerNumber(w, fahrenheitScale ? fahrenheit(value) : value, 3, "null");
+    }
+    writerChar(w, '}');
+}
+
+static void writeJsonEvents(struct report_writer *w, const char *name, const struct top_events *top, int sign)
+{
+    struct extreme_event events[TOP_MAX];
+    int n = sortedEvents(top, events), e;
+    writerString(w, name);
+    writerChar(w, '[');
+    for (e = 0; e < n; e++)
+    {
+        char geohash[13];
+        geohashText(events[e].geohash, geohash);
+        writerString(w, e == 0 ? "\n    {\"geohash\": \"" : ",\n    {\"geohash\": \"");
+        writerString(w, geohash);
+        writerString(w, "\", \"temperature_f\": ");
+        writerFixed(w, fahrenheit(sign * events[e].key), 3);
+        writerString(w, ", \"time\": \"");
+        writerIsoTime(w, (long long)(events[e].timestamp / 1000));
+        writerString(w, "\"}");
+    }
+    writerChar(w, ']');
+}
+
+static void reportJson(struct report_writer *w, const struct climate_table *table)
+{
+    static const char *const unitNames[] = { "", "hour", "day", "month" };
+    int num_states = countStates(table);
+    int i, e;
+    writerString(w, "{\"states\": [");
+    for (i = 0; i < num_states; i++)
+    {
+        const struct climate_info *info = &table->states[i];
+        writerString(w, i == 0 ? "\n  {\"state\": \"" : ",\n  {\"state\": \"");
+        writerString(w, info->code);
+        writerString(w, "\", \"records\": ");
+        writerUnsigned(w, info->num_records);
+        writerString(w, ", \"avg_humidity\": ");
+        writerFixed(w, (info->avgHumidity + info->humidityError) / info->num_records, 3);
+        writerString(w, ", \"avg_temperature_f\": ");
+        writerFixed(w, fahrenheit((info->temperature + info->temperatureError) / info->num_records), 3);
+        writerString(w, ", \"max_temperature_f\": ");
+        writerFixed(w, fahrenheit(info->maxTemp), 3);
+        writerString(w, ", \"max_temperature_time\": \"");
+        writerIsoTime(w, (long long)(info->maxTempTimestamp / 1000));
+        writerString(w, "\", \"min_temperature_f\": ");
+        writerFixed(w, fahrenheit(info->minTemp), 3);
+        writerString(w, ", \"min_temperature_time\": \"");
+        writerIsoTime(w, (long long)(info->minTempTimestamp / 1000));
+        writerString(w, "\", \"lightning\": ");
+        writerInt(w, info->lightning);
+        writerString(w, ", \"snow\": ");
+        writerInt(w, info->snow);
+        writerString(w, ", \"avg_cloud\": ");
+        writerFixed(w, (info->cloud + info->cloudError) / info->num_records, 3);
+        for (e = 0; e < TDV_NUM_EXTRAS; e++)
+        {
+            writerString(w, ", \"avg_");
+            writerString(w, extraColumns[e].name);
+            writerString(w, "\": ");
+            writerFixed(w, (info->extra[e] + info->extraError[e]) / info->num_records, 3);
+        }
+
+        if (options.percentiles)
+        {
+            writeJsonPercentiles(w, ",\n   \"temperature_percentiles_f\": ", &table->digests[i].temperature, 1);
+            writeJsonPercentiles(w, ", \"humidity_percentiles\": ", &table->digests[i].humidity, 0);
+        }
+
+        if (options.geohash_precision > 0)
+        {
+            unsigned int count, n;
+            const struct geo_cell **cells = stateCells(table, stateKey(info->code), &count);
+            writerString(w, ",\n   \"geohash_precision\": ");
+            writerInt(w, options.geohash_precision);
+            writerString(w, ", \"cells\": [");
+            for (n = 0; n < count; n++)
+            {
+                char name[GEOHASH_MAX_PRECISION + 1];
+                cellName(cells[n], name);
+                writerString(w, n == 0 ? "\n    {\"geohash\": \"" : ",\n    {\"geohash\": \"");
+                writerString(w, name);
+                writerChar(w, '"');
+                writeJsonGroup(w, cells[n]->num_records, cells[n]->temperature, cells[n]->minTemp,
+                               cells[n]->maxTemp, cells[n]->humidity, cells[n]->lightning);
+            }
+            writerChar(w, ']');
+            free(cells);
+        }
+
+        if (options.top > 0)
+        {
+            writeJsonEvents(w, ",\n   \"hottest\": ", &table->extremes[i].hottest, 1);
+            writeJsonEvents(w, ",\n   \"coldest\": ", &table->extremes[i].coldest, -1);
+        }
+
+        if (options.geohash_precision > 0 && options.top > 0)
+        {
+            unsigned int count, n;
+            const struct geo_cell **cells = lightningCells(table, stateKey(info->code), &count);
+            writerString(w, ",\n   \"top_lightning_cells\": [");
+            for (n = 0; n < count; n++)
+            {
+                char name[GEOHASH_MAX_PRECISION + 1];
+                cellName(cells[n], name);
+                writerString(w, n == 0 ? "\n    {\"geohash\": \"" : ",\n    {\"geohash\": \"");
+                writerString(w, name);
+                writerChar(w, '"');
+                writeJsonGroup(w, cells[n]->num_records, cells[n]->temperature, cells[n]->minTemp,
+                               cells[n]->maxTemp, cells[n]->humidity, cells[n]->lightning);
+            }
+            writerChar(w, ']');
+            free(cells);
+        }
+
+        if (options.rollup != ROLLUP_NONE)
+        {
+            const struct time_series *series = &table->rollups[i];
+            long long b;
+            int first = 1;
+            writerString(w, ",\n   \"rollup\": \"");
+            writerString(w, unitNames[options.rollup]);
+            writerString(w, "\", \"buckets\": [");
+            for (b = 0; b < series->length; b++)
+            {
+                const struct time_bucket *bucket = &series->buckets[b];
+                char label[32];
+                if (bucket->num_records == 0)
+                {
+                    continue;
+                }
+                long long start = bucketLabel(series->first + b, label, sizeof(label));
+                writerString(w, first ? "\n    {\"start\": \"" : ",\n    {\"start\": \"");
+                writerIsoTime(w, start);
+                writerChar(w, '"');
+                writeJsonGroup(w, bucket->num_records, bucket->temperature, bucket->minTemp,
+                               bucket->maxTemp, bucket->humidity, bucket->lightning);
+                first = 0;
+            }
+            writerChar(w, ']');
+        }
+        writerChar(w, '}');
+    }
+    writerString(w, num_states > 0 ? "\n]}\n" : "]}\n");
+}
+
+static void reportBinary(struct report_writer *w, const struct climate_table *table)
+{
+    static const double quantiles[3] = { 0.50, 0.95, 0.99 };
+    struct report_header header;
+    int num_states = countStates(table);
+    int i, q;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REPORT_MAGIC, sizeof(header.magic));
+    header.version = REPORT_VERSION;
+    header.num_states = (uint32_t)num_states;
+    header.geohash_precision = (uint32_t)options.geohash_precision;
+    header.rollup_unit = (uint32_t)options.rollup;
+    writerBytes(w, &header, sizeof(header));
+
+    for (i = 0; i < num_states; i++)
+    {
+        const struct climate_info *info = &table->states[i];
+        const struct geo_cell **cells = NULL;
+        unsigned int num_cells = 0, n;
+        struct report_state rec;
+        memset(&rec, 0, sizeof(rec));
+        memcpy(rec.code, info->code, sizeof(info->code));
+        rec.num_records = info->num_records;
+        rec.lightning = info->lightning;
+        rec.snow = info->snow;
+        rec.avg_humidity = (info->avgHumidity + info->humidityError) / info->num_records;
+        rec.avg_temperature = fahrenheit((info->temperature + info->temperatureError) / info->num_records);
+        rec.max_temperature = fahrenheit(info->maxTemp);
+        rec.min_temperature = fahrenheit(info->minTemp);
+        rec.avg_cloud = (info->cloud + info->cloudError) / info->num_records;
+        rec.max_time = (int64_t)(info->maxTempTimestamp / 1000);
+        rec.min_time = (int64_t)(info->minTempTimestamp / 1000);
+        for (q = 0; q < 3; q++)
+        {
+            rec.temperature_percentiles[q] = options.percentiles
+                ? fahrenheit(digestQuantile(&table->digests[i].temperature, quantiles[q])) : NAN;
+            rec.humidity_percentiles[q] = options.percentiles
+                ? digestQuantile(&table->digests[i].humidity, quantiles[q]) : NAN;
+        }
+        if (options.geohash_precision > 0)
+        {
+            cells = stateCells(table, stateKey(info->code), &num_cells);
+        }
+        rec.num_cells = num_cells;
+        rec.num_buckets = options.rollup != ROLLUP_NONE ? (uint32_t)usedBuckets(&table->rollups[i]) : 0;
+        writerBytes(w, &rec, sizeof(rec));
+
+        for (n = 0; n < num_cells; n++)
+        {
+            const struct geo_cell *cell = cells[n];
+            struct report_cell out;
+            memset(&out, 0, sizeof(out));
+            cellName(cell, out.geohash);
+            out.num_records = cell->num_records;
+            out.lightning = cell->lightning;
+            out.avg_temperature = fahrenheit(cell->temperature / cell->num_records);
+            out.min_temperature = fahrenheit(cell->minTemp);
+            out.max_temperature = fahrenheit(cell->maxTemp);
+            out.avg_humidity = cell->humidity / cell->num_records;
+            writerBytes(w, &out, sizeof(out));
+        }
+        free(cells);
+
+        if (options.rollup != ROLLUP_NONE)
+        {
+            const struct time_series *series = &table->rollups[i];
+            long long b;
+            for (b = 0; b < series->length; b++)
+            {
+                const struct time_bucket *bucket = &series->buckets[b];
+                struct report_bucket out;
+                char label[32];
+                if (bucket->num_records == 0)
+                {
+                    continue;
+                }
+                memset(&out, 0, sizeof(out));
+                out.start = bucketLabel(series->first + b, label, sizeof(label));
+                out.num_records = bucket->num_records;
+                out.lightning = bucket->lightning;
+                out.avg_temperature = fahrenheit(bucket->temperature / bucket->num_records);
+                out.min_temperature = fahrenheit(bucket->minTemp);
+                out.max_temperature = fahrenheit(bucket->maxTemp);
+                out.avg_humidity = bucket->humidity / bucket->num_records;
+                writerBytes(w, &out, sizeof(out));
+            }
+        }
+    }
+}
+
+#if CLIMATE_STATS
+static unsigned long long statsNanos(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+/* Fine-grained timers use the time stamp counter where there is one; they
+ * are converted to nanoseconds against the wall clock when printed. */
+static unsigned long long statsTicks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return statsNanos(CLOCK_MONOTONIC);
+#endif
+}
+
+static unsigned long long statsOriginTicks, statsOriginNanos;
+
+/**************************************************
+*Charges the time since the last switch to the
+*current phase and makes phase current. Returns the
+*phase that was current.
+**************************************************/
+static int statsSwitch(struct run_stats *stats, int phase)
+{
+    unsigned long long wall = statsNanos(CLOCK_MONOTONIC);
+    unsigned long long cpu = statsNanos(CLOCK_THREAD_CPUTIME_ID);
+    int prev = stats->phase;
+    if (stats->started)
+    {
+        stats->wall[prev] += wall - stats->wall_since;
+        stats->cpu[prev] += cpu - stats->cpu_since;
+    }
+    else if (statsOriginNanos == 0)
+    {
+        statsOriginTicks = statsTicks();
+        statsOriginNanos = wall;
+    }
+    stats->started = 1;
+    stats->phase = phase;
+    stats->wall_since = wall;
+    stats->cpu_since = cpu;
+    return prev;
+}
+
+/**************************************************
+*Prints the counters and phase times of a run to
+*stderr
+**************************************************/
+void print_stats(struct climate_table *table)
+{
+    static const char *const phaseNames[NUM_PHASES] = { "other", "io", "scan", "accumulate", "merge", "report" };
+    struct run_stats *stats = &table->stats;
+    struct rusage usage;
+    int p;
+
+    statsSwitch(stats, PHASE_OTHER);
+    unsigned long long ticks = statsTicks() - statsOriginTicks;
+    unsigned long long nanos = statsNanos(CLOCK_MONOTONIC) - statsOriginNanos;
+    double ticks_per_ms = nanos > 0 ? ticks / (nanos / 1e6) : 1;
+    double parse_ms = stats->parse_ticks / ticks_per_ms;
+    double lookup_ms = stats->lookup_ticks / ticks_per_ms;
+    double scan_ms = stats->wall[PHASE_SCAN] / 1e6;
+
+    fprintf(stderr, "Bytes read: %llu (%.1f MB)\n", stats->bytes, stats->bytes / 1e6);
+    fprintf(stderr, "Lines: %llu, records: %llu, malformed lines: %llu, state table misses: %llu\n",
+            stats->lines, stats->records, stats->malformed, stats->state_misses);
+    if (options.filtering)
+    {
+        fprintf(stderr, "Filtered records: %llu, cache blocks skipped: %llu, zones skipped: %llu\n", stats->filtered,
+                stats->blocks_skipped, stats->zones_skipped);
+    }
+    if (stats->chunks > 0)
+    {
+        fprintf(stderr, "Parallel chunks: %llu, stolen: %llu", stats->chunks, stats->steals);
+        if (options.numa)
+        {
+            fprintf(stderr, " (%llu from other nodes)", stats->remote_steals);
+        }
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "%-14s %12s %12s\n", "Phase", "wall ms", "cpu ms");
+    for (p = 1; p < NUM_PHASES; p++)
+    {
+        fprintf(stderr, "%-14s %12.1f %12.1f\n", phaseNames[p], stats->wall[p] / 1e6, stats->cpu[p] / 1e6);
+        if (p == PHASE_SCAN)
+        {
+            double tokenize_ms = scan_ms - parse_ms - lookup_ms;
+            fprintf(stderr, "  %-12s %12.1f\n", "tokenize", tokenize_ms > 0 ? tokenize_ms : 0);
+            fprintf(stderr, "  %-12s %12.1f\n", "parse", parse_ms);
+            fprintf(stderr, "  %-12s %12.1f\n", "state lookup", lookup_ms);
+        }
+    }
+    fprintf(stderr, "%-14s %12.1f %12.1f\n", phaseNames[PHASE_OTHER], stats->wall[PHASE_OTHER] / 1e6,
+            stats->cpu[PHASE_OTHER] / 1e6);
+
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu_ms = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3
+                  + usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+    fprintf(stderr, "%-14s %12.1f %12.1f (process; phases with -j are summed over threads)\n", "total",
+            nanos / 1e6, cpu_ms);
+    if (nanos > 0)
+    {
+        fprintf(stderr, "Throughput: %.1f MB/s, %.2fM records/s\n", stats->bytes / (nanos / 1e3),
+                stats->records / (nanos / 1e3));
+    }
+}
+#else
+void print_stats(struct climate_table *table)
+{
+    (void)table;
+}
+#endif
+
+/**************************************************
+*Writes the report for table to stdout in the format
+*chosen with --format
+**************************************************/
+void print_report(const struct climate_table *table)
+{
+    write_report(stdout, table, options.format);
+}
+
+/**************************************************
+*Writes the report for table to out
+**************************************************/
+void write_report(FILE *out, const struct climate_table *table, enum report_format format)
+{
+    struct report_writer w = { out, malloc(REPORT_BUFFER_SIZE), 0 };
+    switch (format)
+    {
+    case FORMAT_CSV:
+        reportCsv(&w, table);
+        break;
+    case FORMAT_JSON:
+        reportJson(&w, table);
+        break;
+    case FORMAT_BINARY:
+        reportBinary(&w, table);
+        break;
+    default:
+        reportText(&w, table);
+        break;
+    }
+    writerFlush(&w);
+    fflush(out);
+    free(w.buffer);
+}
+
+/* --sample and --time-budget read the mapped input in newline-aligned
+ * chunks of about SAMPLE_CHUNK bytes in a stratified random order: each
+ * file is cut into strata of SAMPLE_STRATUM consecutive chunks, and pass p
+ * of the order reads one unread chunk of every stratum, the strata in
+ * random order. Any prefix of the order is spread evenly over the input.
+ * Records within a chunk are not independent, so the estimates treat the
+ * chunks as the sampling units: a cluster sample without replacement. */
+#define SAMPLE_CHUNK ((size_t)256 << 10)
+#define SAMPLE_STRATUM 16
+#define SAMPLE_Z 1.96                   //two-sided 95% intervals
+
+enum sample_value { SAMPLE_HUMIDITY, SAMPLE_TEMPERATURE, SAMPLE_CLOUD, SAMPLE_LIGHTNING, SAMPLE_SNOW, SAMPLE_EXTRA };
+#define SAMPLE_VALUES (SAMPLE_EXTRA + TDV_NUM_EXTRAS)
+
+struct sample_chunk {
+    const char *data;
+    size_t len;
+    uint64_t order;                 //pass in the high half, a random tie-break below
+};
+
+/* Per-state sums over the chunks read so far of each chunk's record count n
+ * and value totals y: n, n^2 and for every value y, y^2 and n*y. */
+struct sample_sums {
+    double n, n2;
+    double y[SAMPLE_VALUES];
+    double y2[SAMPLE_VALUES];
+    double ny[SAMPLE_VALUES];
+};
+
+/* A state's running totals, by sample_value */
+static void sampleTotals(const struct climate_info *info, double y[SAMPLE_VALUES])
+{
+    int e;
+    y[SAMPLE_HUMIDITY] = info->avgHumidity + info->humidityError;
+    y[SAMPLE_TEMPERATURE] = info->temperature + info->temperatureError;
+    y[SAMPLE_CLOUD] = info->cloud + info->cloudError;
+    y[SAMPLE_LIGHTNING] = info->lightning;
+    y[SAMPLE_SNOW] = info->snow;
+    for (e = 0; e < TDV_NUM_EXTRAS; e++)
+    {
+        y[SAMPLE_EXTRA + e] = info->extra[e] + info->extraError[e];
+    }
+}
+
+static uint64_t sampleRandom(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static int compareSampleChunks(const void *a, const void *b)
+{
+    const struct sample_chunk *x = a, *y = b;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**************************************************
+*Returns the half width of the interval of a mean
+*(sum y / sum n) over m of M chunks
+**************************************************/
+static double sampleMeanError(const struct sample_sums *s, int v, double m, double M)
+{
+    if (m < 2 || s->n == 0)
+    {
+        return NAN;
+    }
+    double mean = s->y[v] / s->n;
+    double nbar = s->n / m;
+    double spread = (s->y2[v] - 2 * mean * s->ny[v] + mean * mean * s->n2) / (m - 1);
+    double variance = (1 - m / M) * fmax(spread, 0) / (m * nbar * nbar);
+    return SAMPLE_Z * sqrt(variance);
+}
+
+/**************************************************
+*Returns the half width of the interval of a total
+*scaled up from m of M chunks with sums sum and sum2
+**************************************************/
+static double sampleTotalError(double sum, double sum2, double m, double M)
+{
+    if (m < 2)
+    {
+        return NAN;
+    }
+    double spread = (sum2 - sum * sum / m) / (m - 1);
+    return SAMPLE_Z * M * sqrt((1 - m / M) * fmax(spread, 0) / m);
+}
+
+static void writeEstimate(struct report_writer *w, const char *label, double value, double error, int digits,
+                          const char *unit)
+{
+    writerString(w, label);
+    writerFixed(w, value, digits);
+    writerString(w, unit);
+    writerString(w, " +/- ");
+    writerNumber(w, error, digits, "?");
+    writerString(w, unit);
+    writerChar(w, '\n');
+}
+
+/**************************************************
+*Prints the text report estimated from m of the M
+*chunks, with 95% intervals. Counts are scaled up to
+*the whole input; the extremes are those of the
+*records read so far.
+**************************************************/
+static void printEstimate(const struct climate_table *table, const struct sample_sums *sums, int m, int M)
+{
+    struct report_writer w = { stdout, malloc(REPORT_BUFFER_SIZE), 0 };
+    int num_states = countStates(table);
+    int i, e;
+    writerString(&w, "Estimate from ");
+    writerInt(&w, m);
+    writerString(&w, " of ");
+    writerInt(&w, M);
+    writerString(&w, " chunks (");
+    writerFixed(&w, 100.0 * m / M, 1);
+    writerString(&w, "%), 95% intervals\nStates found: ");
     for (i = 0; i < num_states; ++i)
     {
-        if (states[i] != NULL)
+        writerString(&w, table->states[i].code);
+        writerChar(&w, ' ');
+    }
+    writerChar(&w, '\n');
+
+    for (i = 0; i < num_states; i++)
+    {
+        const struct climate_info *info = &table->states[i];
+        const struct sample_sums *s = &sums[i];
+        double scale = (double)M / m;
+        writerString(&w, "-- State: ");
+        writerString(&w, info->code);
+        writerString(&w, " --\n");
+        writeEstimate(&w, "Number of Records: ", s->n * scale, sampleTotalError(s->n, s->n2, m, M), 0, "");
+        writeEstimate(&w, "Average Humidity: ", s->y[SAMPLE_HUMIDITY] / s->n, sampleMeanError(s, SAMPLE_HUMIDITY, m, M),
+                      1, "%");
+        writeEstimate(&w, "Average Temperature: ", fahrenheit(s->y[SAMPLE_TEMPERATURE] / s->n),
+                      1.8 * sampleMeanError(s, SAMPLE_TEMPERATURE, m, M), 1, "F");
+        writerString(&w, "Max Temperature (so far): ");
+        writerFixed(&w, fahrenheit(info->maxTemp), 1);
+        writerString(&w, "F\nMax Temperature on: ");
+        writerCtime(&w, (time_t)(info->maxTempTimestamp / 1000));
+        writerString(&w, "Min Temperature (so far): ");
+        writerFixed(&w, fahrenheit(info->minTemp), 1);
+        writerString(&w, "F\nMin Temperature on: ");
+        writerCtime(&w, (time_t)(info->minTempTimestamp / 1000));
+        writeEstimate(&w, "Lightning Strikes: ", s->y[SAMPLE_LIGHTNING] * scale,
+                      sampleTotalError(s->y[SAMPLE_LIGHTNING], s->y2[SAMPLE_LIGHTNING], m, M), 0, "");
+        writeEstimate(&w, "Records with Snow Cover: ", s->y[SAMPLE_SNOW] * scale,
+                      sampleTotalError(s->y[SAMPLE_SNOW], s->y2[SAMPLE_SNOW], m, M), 0, "");
+        writeEstimate(&w, "Average Cloud Cover: ", s->y[SAMPLE_CLOUD] / s->n, sampleMeanError(s, SAMPLE_CLOUD, m, M),
+                      1, "%");
+        for (e = 0; e < TDV_NUM_EXTRAS; e++)
         {
-            struct climate_info *info = states[i];
-            printf("%s ", info->code);
+            writerString(&w, "Average ");
+            writerString(&w, extraColumns[e].label);
+            writeEstimate(&w, ": ", s->y[SAMPLE_EXTRA + e] / s->n, sampleMeanError(s, SAMPLE_EXTRA + e, m, M), 1, "");
         }
     }
-    printf("\n");
-    
-    /* TODO: Print out the summary for each state. See format above. */
-    
-    for (i = 0; i < num_states && states[i] != NULL; i++)
-    {
-        const long MAX = (((*(states + i))->maxTempTimestamp) / 1000);//time conversion
-        const long MIN = (((*(states + i))->minTempTimestamp) / 1000);
-        double aTemp = ((states[i]->temperature) / (states[i]->num_records)) * 1.8 - 459.67;//temperature conversions
-        double lTemp =  (states[i]->minTemp) * 1.8 - 459.67;
-        double hTemp =  (states[i]->maxTemp) * 1.8 - 459.67;
-        
-        printf("-- State: %s --\n", states[i]->code);
-        printf("Number of Records: %d\n", states[i]->num_records);
-        printf("Average Humidity: %.1f%%\n", (states[i]->avgHumidity) / ((states[i]->num_records)));
-        printf("Average Temperature: %.1fF\n", aTemp);
-        printf("Max Temperature: %.1fF\n", hTemp);
-        printf("Max Temperature on: %s", ctime(&MAX));
-        printf("Min Temperature: %.1fF\n", lTemp);
-        printf("Min Temperature on: %s", ctime(&MIN));
-        printf("Lightning Strikes: %d\n", states[i]->lightning);
-        printf("Records with Snow Cover: %d\n", states[i]->snow);
-        printf("Average Cloud Cover: %.1lf%% \n", (states[i]->cloud / (states[i]->num_records)));
+    writerFlush(&w);
+    fflush(stdout);
+    free(w.buffer);
+}
+
+/**************************************************
+*Analyzes a sample of a set of mapped files: chunks
+*are read in stratified random order until a share
+*rate of them is read. With a time budget, an
+*estimate is printed each time another budget_ms
+*has passed. Returns 1 if every chunk was read (the
+*table is then exact and the caller reports it), 0
+*after printing the final estimate, or -1 if a file
+*is compressed or a cache and cannot be sampled.
+**************************************************/
+int analyze_sampled(const char *paths[], const char *data[], const size_t sizes[], int num_files, double rate,
+                    long long budget_ms, struct climate_table *table)
+{
+    size_t total = 0;
+    int f, c;
+    for (f = 0; f < num_files; f++)
+    {
+        if (inputKind((const unsigned char *)data[f], sizes[f]) != INPUT_PLAIN
+            || (sizes[f] >= sizeof(CACHE_MAGIC) - 1 && memcmp(data[f], CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1) == 0))
+        {
+            fprintf(stderr, "Cannot sample %s: only uncompressed TDV files can be sampled\n", paths[f]);
+            return -1;
+        }
+        total += sizes[f];
+    }
+    struct sample_chunk *chunks = calloc(total / SAMPLE_CHUNK + (size_t)num_files + 1, sizeof(*chunks));
+    int num_chunks = 0;
+    uint64_t seed = 1;
+    for (f = 0; f < num_files; f++)
+    {
+        size_t offset = 0;
+        int first = num_chunks;
+        while (offset < sizes[f])
+        {
+            size_t take = sizes[f] - offset;
+            if (take > SAMPLE_CHUNK)
+            {
+                const char *nl = memchr(data[f] + offset + SAMPLE_CHUNK, '\n', take - SAMPLE_CHUNK);
+                take = nl != NULL ? (size_t)(nl - (data[f] + offset)) + 1 : take;
+            }
+            chunks[num_chunks].data = data[f] + offset;
+            chunks[num_chunks].len = take;
+            num_chunks++;
+            offset += take;
+        }
+        madvise((void *)data[f], sizes[f], MADV_RANDOM);
+
+        //a random permutation of each stratum gives every chunk its pass
+        for (c = first; c < num_chunks; c += SAMPLE_STRATUM)
+        {
+            int passes[SAMPLE_STRATUM], n = num_chunks - c < SAMPLE_STRATUM ? num_chunks - c : SAMPLE_STRATUM, p;
+            for (p = 0; p < n; p++)
+            {
+                int j = (int)(sampleRandom(&seed) % (uint64_t)(p + 1));
+                passes[p] = passes[j];
+                passes[j] = p;
+            }
+            for (p = 0; p < n; p++)
+            {
+                chunks[c + p].order = ((uint64_t)passes[p] << 32) | (sampleRandom(&seed) >> 32);
+            }
+        }
+    }
+    qsort(chunks, num_chunks, sizeof(*chunks), compareSampleChunks);
+
+    int wanted = (int)ceil(rate * num_chunks);
+    wanted = wanted < 1 ? 1 : wanted > num_chunks ? num_chunks : wanted;
+    struct sample_sums *sums = calloc(NUM_STATES, sizeof(*sums));
+    double (*before)[SAMPLE_VALUES] = calloc(NUM_STATES, sizeof(*before));
+    unsigned int *before_records = calloc(NUM_STATES, sizeof(*before_records));
+    struct timespec start, now;
+    long long reported = 0;
+    int v;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (c = 0; c < wanted; c++)
+    {
+        int i, num_states = countStates(table);
+        for (i = 0; i < num_states; i++)
+        {
+            before_records[i] = table->states[i].num_records;
+            sampleTotals(&table->states[i], before[i]);
+        }
+
+        size_t lead = (uintptr_t)chunks[c].data & (uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+        madvise((char *)chunks[c].data - lead, chunks[c].len + lead, MADV_WILLNEED);
+        analyze_buffer(chunks[c].data, chunks[c].len, table);
+
+        //states first seen in this chunk start from nothing
+        for (i = num_states; i < countStates(table); i++)
+        {
+            before_records[i] = 0;
+            memset(before[i], 0, sizeof(before[i]));
+        }
+        for (i = 0; i < countStates(table); i++)
+        {
+            double y[SAMPLE_VALUES];
+            double n = (double)(table->states[i].num_records - before_records[i]);
+            sampleTotals(&table->states[i], y);
+            sums[i].n += n;
+            sums[i].n2 += n * n;
+            for (v = 0; v < SAMPLE_VALUES; v++)
+            {
+                double d = y[v] - before[i][v];
+                sums[i].y[v] += d;
+                sums[i].y2[v] += d * d;
+                sums[i].ny[v] += n * d;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long elapsed = (now.tv_sec - start.tv_sec) * 1000LL + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (budget_ms > 0 && elapsed >= reported + budget_ms && c + 1 < wanted)
+        {
+            printEstimate(table, sums, c + 1, num_chunks);
+            putchar('\n');
+            reported = elapsed;
+        }
+    }
+
+    int complete = wanted == num_chunks;
+    if (!complete)
+    {
+        printEstimate(table, sums, wanted, num_chunks);
     }
+    free(before_records);
+    free(before);
+    free(sums);
+    free(chunks);
+    return complete;
 }
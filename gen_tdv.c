@@ -0,0 +1,272 @@
+/**
+ * gen_tdv.c
+ *
+ * Writes synthetic climate data in the TDV format read by climate.c, for
+ * benchmarks and testing.
+ *
+ * Compile:  make gen_tdv
+ *
+ * Example Run:      ./gen_tdv -n 1000000 -s TN,WA,CA -g 64 -o data.tdv
+ *
+ * Options:
+ *      -n records      number of records to write (default 1000000)
+ *      -s states       comma-separated state codes, or a count N to use
+ *                      the first N of the 50 states (default 50)
+ *      -g cells        distinct 4-character geohash cells per state
+ *                      (default 64)
+ *      -b run          average number of consecutive records from the
+ *                      same state (default 1: every record picks a state)
+ *      -y year         calendar year of the timestamps (default 2015)
+ *      -r seed         random seed (default 1)
+ *      -w              append wind speed, wind direction and precipitation
+ *                      columns (the NOAA_WIND layout in climate.c)
+ *      -o file         output file (default stdout)
+ *
+ * Records are hourly observations. Temperature follows a seasonal and a
+ * daily cycle around a per-state mean; humidity, cloud cover, snow and
+ * lightning are loosely tied to it, so aggregates look like real data.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_STATES 50
+#define CELL_CHARS 4
+#define GEOHASH_CHARS 12
+
+static const char *const allStates[MAX_STATES] = {
+    "AL", "AK", "AZ", "AR", "CA", "CO", "CT", "DE", "FL", "GA",
+    "HI", "ID", "IL", "IN", "IA", "KS", "KY", "LA", "ME", "MD",
+    "MA", "MI", "MN", "MS", "MO", "MT", "NE", "NV", "NH", "NJ",
+    "NM", "NY", "NC", "ND", "OH", "OK", "OR", "PA", "RI", "SC",
+    "SD", "TN", "TX", "UT", "VT", "VA", "WA", "WV", "WI", "WY"
+};
+
+static const char geohashAlphabet[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+
+struct state_profile {
+    char code[3];
+    double meanTemp;        //Kelvin
+    double swing;           //half the summer/winter difference
+    char (*cells)[CELL_CHARS];
+};
+
+static uint64_t rng;
+
+/**************************************************
+*Returns the next 64 random bits (xorshift64*)
+**************************************************/
+static uint64_t nextRandom(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545F4914F6CDD1DULL;
+}
+
+/**************************************************
+*Returns a uniform random number in [0, 1)
+**************************************************/
+static double uniform(void)
+{
+    return (double)(nextRandom() >> 11) / 9007199254740992.0;
+}
+
+/**************************************************
+*Returns a normally distributed random number
+**************************************************/
+static double gaussian(void)
+{
+    return sqrt(-2 * log(1 - uniform())) * cos(2 * M_PI * uniform());
+}
+
+/**************************************************
+*Fills in the state list from -s (codes or a count).
+*Returns the number of states, or 0 if invalid.
+**************************************************/
+static int parseStates(const char *arg, struct state_profile *states)
+{
+    char *end;
+    long count = strtol(arg, &end, 10);
+    int n = 0;
+    if (*end == '\0')
+    {
+        if (count < 1 || count > MAX_STATES)
+        {
+            return 0;
+        }
+        for (n = 0; n < count; n++)
+        {
+            memcpy(states[n].code, allStates[n], 3);
+        }
+        return n;
+    }
+
+    while (*arg != '\0')
+    {
+        if (n == MAX_STATES || strlen(arg) < 2 || (arg[2] != ',' && arg[2] != '\0'))
+        {
+            return 0;
+        }
+        states[n].code[0] = arg[0];
+        states[n].code[1] = arg[1];
+        states[n].code[2] = '\0';
+        n++;
+        arg += arg[2] == ',' ? 3 : 2;
+    }
+    return n;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n records] [-s states] [-g cells] [-b run] [-y year] [-r seed] [-w] [-o file]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct state_profile states[MAX_STATES];
+    long long records = 1000000;
+    int num_states = 0;
+    int num_cells = 64;
+    double run = 1;
+    int year = 2015;
+    const char *path = NULL;
+    int wind = 0;
+    int opt;
+
+    rng = 1;
+    while ((opt = getopt(argc, argv, "n:s:g:b:y:r:wo:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            records = atoll(optarg);
+            break;
+        case 's':
+            num_states = parseStates(optarg, states);
+            if (num_states == 0)
+            {
+                fprintf(stderr, "Invalid state list: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'g':
+            num_cells = atoi(optarg);
+            break;
+        case 'b':
+            run = atof(optarg);
+            break;
+        case 'y':
+            year = atoi(optarg);
+            break;
+        case 'r':
+            rng = strtoull(optarg, NULL, 10) * 0x9E3779B97F4A7C15ULL + 1;
+            break;
+        case 'w':
+            wind = 1;
+            break;
+        case 'o':
+            path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (records < 0 || num_cells < 1 || run < 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (num_states == 0)
+    {
+        num_states = parseStates("50", states);
+    }
+
+    FILE *out = path != NULL ? fopen(path, "w") : stdout;
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not open %s for writing.\n", path);
+        return EXIT_FAILURE;
+    }
+
+    /* Each state gets a climate and a two-character geohash region with
+     * num_cells cells in it. */
+    int s, c;
+    for (s = 0; s < num_states; s++)
+    {
+        states[s].meanTemp = 278 + 14 * uniform();
+        states[s].swing = 6 + 12 * uniform();
+        states[s].cells = malloc((size_t)num_cells * CELL_CHARS);
+        char region[2] = { geohashAlphabet[nextRandom() % 32], geohashAlphabet[nextRandom() % 32] };
+        for (c = 0; c < num_cells; c++)
+        {
+            states[s].cells[c][0] = region[0];
+            states[s].cells[c][1] = region[1];
+            states[s].cells[c][2] = geohashAlphabet[nextRandom() % 32];
+            states[s].cells[c][3] = geohashAlphabet[nextRandom() % 32];
+        }
+    }
+
+    //hours since the epoch at the start of the year
+    long long y = year - 1;
+    long long days = 365 * (y - 1969) + (y - 1968) / 4 - (y - 1900) / 100 + (y - 1600) / 400;
+    long long first_hour = days * 24;
+    int hours_in_year = ((year % 4 == 0 && year % 100 != 0) || year % 400 == 0) ? 366 * 24 : 365 * 24;
+
+    long long i;
+    int current = 0;
+    for (i = 0; i < records; i++)
+    {
+        if (run == 1 || uniform() < 1 / run)
+        {
+            current = (int)(nextRandom() % (uint64_t)num_states);
+        }
+        const struct state_profile *state = &states[current];
+
+        int hour = (int)(nextRandom() % (uint64_t)hours_in_year);
+        double season = -cos(2 * M_PI * (hour / 24 - 15) / 365.25);
+        double daily = -cos(2 * M_PI * ((hour % 24) - 3) / 24);
+        double temperature = state->meanTemp + state->swing * season + 5 * daily + 4 * gaussian();
+        double humidity = floor(fmin(100, fmax(0, 60 - 15 * daily + 20 * gaussian())));
+        double cloud = uniform() < 0.3 ? 0 : uniform() < 0.4 ? 100 : floor(1000 * uniform()) / 10;
+        int snow = temperature < 273.15 && uniform() < 0.6;
+        int lightning = cloud > 50 && temperature > 285 && uniform() < 0.08;
+        double pressure = floor(101325 - 3000 * uniform() - 1500 * fabs(gaussian()));
+
+        char geohash[GEOHASH_CHARS + 1];
+        memcpy(geohash, state->cells[nextRandom() % (uint64_t)num_cells], CELL_CHARS);
+        for (c = CELL_CHARS; c < GEOHASH_CHARS; c++)
+        {
+            geohash[c] = geohashAlphabet[nextRandom() % 32];
+        }
+        geohash[GEOHASH_CHARS] = '\0';
+
+        fprintf(out, "%s\t%lld\t%s\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.5f",
+                state->code, (first_hour + hour) * 3600000LL, geohash, humidity,
+                (double)snow, cloud, (double)lightning, pressure, temperature);
+        if (wind)
+        {
+            //stronger wind and more rain under heavy cloud
+            double speed = fabs(3 + 0.05 * cloud + 2.5 * gaussian());
+            double rain = cloud > 60 && uniform() < 0.3 ? floor(200 * uniform() * uniform()) / 10 : 0;
+            fprintf(out, "\t%.1f\t%.0f\t%.1f", speed, floor(360 * uniform()), rain);
+        }
+        putc('\n', out);
+    }
+
+    for (s = 0; s < num_states; s++)
+    {
+        free(states[s].cells);
+    }
+    if (out != stdout && fclose(out) != 0)
+    {
+        fprintf(stderr, "Could not write %s.\n", path);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}